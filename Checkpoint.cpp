@@ -16,14 +16,21 @@
 
 #define LOG_TAG "Checkpoint"
 #include "Checkpoint.h"
+#include "Crc32.h"
 #include "FsCrypt.h"
 #include "KeyStorage.h"
 #include "VoldUtil.h"
 #include "VolumeManager.h"
 
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
 #include <fstream>
 #include <list>
+#include <map>
 #include <memory>
+#include <mutex>
+#include <optional>
 #include <string>
 #include <thread>
 #include <vector>
@@ -37,11 +44,13 @@
 #include <cutils/android_reboot.h>
 #include <fcntl.h>
 #include <fs_mgr.h>
+#include <limits.h>
 #include <linux/fs.h>
 #include <mntent.h>
 #include <sys/mount.h>
 #include <sys/stat.h>
 #include <sys/statvfs.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
 using android::base::GetBoolProperty;
@@ -159,9 +168,17 @@ volatile bool needsCheckpointWasCalled = false;
 // Protects isCheckpointing, needsCheckpointWasCalled and code that makes decisions based on status
 // of isCheckpointing
 std::mutex isCheckpointingLock;
+
+// Held by cp_prepareCheckpoint, which drops isCheckpointingLock while trimming, so that it runs
+// once at a time and a commit waits for the dm-bow devices to reach state 1.  Taken before
+// isCheckpointingLock.
+std::mutex prepareCheckpointLock;
+
+void wakeHealthMonitor();
 }
 
 Status cp_commitChanges() {
+    std::lock_guard<std::mutex> prepare_lock(prepareCheckpointLock);
     std::lock_guard<std::mutex> lock(isCheckpointingLock);
 
     if (!isCheckpointing) {
@@ -218,6 +235,7 @@ Status cp_commitChanges() {
     SetProperty("vold.checkpoint_committed", "1");
     LOG(INFO) << "Checkpoint has been committed.";
     isCheckpointing = false;
+    wakeHealthMonitor();
     if (!android::base::RemoveFileIfExists(kMetadataCPFile, &err_str))
         return error(err_str.c_str());
 
@@ -320,24 +338,117 @@ const uint64_t min_free_bytes_default = 100 * (1 << 20);  // 100 MiB
 const std::string kCommitOnFullProp = "ro.sys.cp_commit_on_full";
 const bool commit_on_full_default = true;
 
-static void cp_healthDaemon(std::string mnt_pnt, std::string blk_device, bool is_fs_cp) {
-    struct statvfs data;
-    uint32_t msleeptime = GetUintProperty(kSleepTimeProp, msleeptime_default, max_msleeptime);
-    uint64_t min_free_bytes =
-        GetUintProperty(kMinFreeBytesProp, min_free_bytes_default, (uint64_t)-1);
-    bool commit_on_full = GetBoolProperty(kCommitOnFullProp, commit_on_full_default);
-
-    struct timespec req;
-    req.tv_sec = msleeptime / 1000;
-    msleeptime %= 1000;
-    req.tv_nsec = msleeptime * 1000000;
-    while (isCheckpointing) {
+// How often to sample free space: faster when it is running out, and slower
+// when nothing is being written.
+const std::chrono::milliseconds kMinPollInterval{100};
+const std::chrono::milliseconds kMaxPollInterval{60 * 1000};
+// Sample again after a quarter of the time that free space would last at the
+// current rate, so that the rate is measured a few times before it runs out.
+const int kPollsBeforeFull = 4;
+// But never wait for longer than free space would last if writes started at
+// this rate, in bytes per second.
+const uint64_t kMaxConsumptionRate = 512 * (1 << 20);
+
+// Watches the free space of every checkpointed filesystem from one thread, and
+// commits or aborts the checkpoint when any of them runs low.
+class HealthMonitor {
+  public:
+    static HealthMonitor& Instance() {
+        static HealthMonitor monitor;
+        return monitor;
+    }
+
+    void Add(const std::string& mount_point, const std::string& blk_device, bool is_fs_cp) {
+        std::lock_guard<std::mutex> lock(lock_);
+        if (!running_) {
+            filesystems_.clear();
+            min_free_bytes_seen_.reset();
+            running_ = true;
+            std::thread(&HealthMonitor::Run, this).detach();
+        }
+        Filesystem fs;
+        fs.blk_device = blk_device;
+        fs.is_fs_cp = is_fs_cp;
+        fs.health.mount_point = mount_point;
+        fs.health.min_free_bytes = min_free_bytes_;
+        filesystems_.push_back(std::move(fs));
+        cv_.notify_one();
+    }
+
+    // Makes the monitor notice that the checkpoint has ended.  Holding lock_ means Run() is
+    // either waiting, or yet to check isCheckpointing, so the wakeup can't be lost.
+    void Wake() {
+        std::lock_guard<std::mutex> lock(lock_);
+        cv_.notify_one();
+    }
+
+    std::vector<CheckpointHealth> Samples() {
+        std::lock_guard<std::mutex> lock(lock_);
+        std::vector<CheckpointHealth> samples;
+        for (const auto& fs : filesystems_) samples.push_back(fs.health);
+        return samples;
+    }
+
+    bool MinFreeSpace(uint64_t* free_bytes, std::string* mount_point) {
+        std::lock_guard<std::mutex> lock(lock_);
+        if (!min_free_bytes_seen_) return false;
+        *free_bytes = *min_free_bytes_seen_;
+        *mount_point = min_free_mount_point_;
+        return true;
+    }
+
+  private:
+    struct Filesystem {
+        std::string blk_device;
+        bool is_fs_cp;
+        CheckpointHealth health;
+        std::chrono::steady_clock::time_point next_poll;
+    };
+
+    HealthMonitor()
+        : poll_interval_(GetUintProperty(kSleepTimeProp, msleeptime_default, max_msleeptime)),
+          min_free_bytes_(
+                  GetUintProperty(kMinFreeBytesProp, min_free_bytes_default, (uint64_t)-1)),
+          commit_on_full_(GetBoolProperty(kCommitOnFullProp, commit_on_full_default)) {}
+
+    void Run() {
+        std::unique_lock<std::mutex> lock(lock_);
+        while (isCheckpointing) {
+            auto now = std::chrono::steady_clock::now();
+            auto next_poll = std::chrono::steady_clock::time_point::max();
+            bool low_space = false;
+            for (auto& fs : filesystems_) {
+                if (fs.next_poll <= now) low_space |= !Poll(&fs, now);
+                next_poll = std::min(next_poll, fs.next_poll);
+            }
+            if (low_space) {
+                running_ = false;
+                lock.unlock();
+                if (commit_on_full_) {
+                    LOG(INFO) << "Low space for checkpointing. Commiting changes";
+                    cp_commitChanges();
+                } else {
+                    LOG(INFO) << "Low space for checkpointing. Rebooting";
+                    cp_abortChanges("checkpoint,low_space", false);
+                }
+                return;
+            }
+            cv_.wait_until(lock, next_poll);
+        }
+        running_ = false;
+    }
+
+    // Samples the free space of |fs| and schedules its next sample.  Returns
+    // false if it is too low.
+    bool Poll(Filesystem* fs, std::chrono::steady_clock::time_point now) {
         uint64_t free_bytes = 0;
-        if (is_fs_cp) {
-            statvfs(mnt_pnt.c_str(), &data);
-            free_bytes = ((uint64_t) data.f_bavail) * data.f_frsize;
+        if (fs->is_fs_cp) {
+            struct statvfs data;
+            if (statvfs(fs->health.mount_point.c_str(), &data) == 0) {
+                free_bytes = ((uint64_t)data.f_bavail) * data.f_frsize;
+            }
         } else {
-            std::string bow_device = fs_mgr_find_bow_device(blk_device);
+            std::string bow_device = fs_mgr_find_bow_device(fs->blk_device);
             if (!bow_device.empty()) {
                 std::string content;
                 if (android::base::ReadFileToString(bow_device + "/bow/free", &content)) {
@@ -345,29 +456,136 @@ static void cp_healthDaemon(std::string mnt_pnt, std::string blk_device, bool is
                 }
             }
         }
-        if (free_bytes < min_free_bytes) {
-            if (commit_on_full) {
-                LOG(INFO) << "Low space for checkpointing. Commiting changes";
-                cp_commitChanges();
-                break;
+
+        CheckpointHealth& health = fs->health;
+        int64_t time_ms = nanoseconds_to_milliseconds(systemTime(SYSTEM_TIME_BOOTTIME));
+        uint64_t headroom = free_bytes > min_free_bytes_ ? free_bytes - min_free_bytes_ : 0;
+        std::chrono::milliseconds interval = poll_interval_;
+        if (health.time_ms != 0 && time_ms > health.time_ms) {
+            // Average the rate over the last few samples, so that one burst of
+            // writes doesn't make the monitor spin.
+            uint64_t used = health.free_bytes > free_bytes ? health.free_bytes - free_bytes : 0;
+            uint64_t rate = used * 1000 / (time_ms - health.time_ms);
+            health.consumption_rate = (health.consumption_rate + rate) / 2;
+            if (health.consumption_rate > 0) {
+                interval = std::chrono::milliseconds(headroom * 1000 / health.consumption_rate /
+                                                     kPollsBeforeFull);
             } else {
-                LOG(INFO) << "Low space for checkpointing. Rebooting";
-                cp_abortChanges("checkpoint,low_space", false);
-                break;
+                interval = std::chrono::milliseconds(health.poll_interval_ms * 2);
             }
         }
-        nanosleep(&req, NULL);
+        interval = std::min(interval,
+                            std::chrono::milliseconds(headroom * 1000 / kMaxConsumptionRate));
+        interval = std::clamp(interval, std::min(kMinPollInterval, poll_interval_),
+                              std::max(kMaxPollInterval, poll_interval_));
+
+        if (!min_free_bytes_seen_ || free_bytes < *min_free_bytes_seen_) {
+            min_free_bytes_seen_ = free_bytes;
+            min_free_mount_point_ = health.mount_point;
+        }
+        health.free_bytes = free_bytes;
+        health.time_ms = time_ms;
+        health.poll_interval_ms = interval.count();
+        fs->next_poll = now + interval;
+        return free_bytes >= min_free_bytes_;
     }
+
+    // The first interval, and the bounds of later ones if they are outside
+    // kMinPollInterval to kMaxPollInterval.
+    const std::chrono::milliseconds poll_interval_;
+    const uint64_t min_free_bytes_;
+    const bool commit_on_full_;
+
+    std::mutex lock_;
+    std::condition_variable cv_;
+    std::vector<Filesystem> filesystems_;
+    bool running_ = false;
+    std::optional<uint64_t> min_free_bytes_seen_;
+    std::string min_free_mount_point_;
+};
+
+void wakeHealthMonitor() {
+    HealthMonitor::Instance().Wake();
 }
 
+const std::string kTrimTimeoutProp = "ro.sys.cp_trim_timeout_ms";
+const uint32_t trim_timeout_default = 10000;  // 10 s
+const uint32_t max_trim_timeout = 3600000;    // 1 h
+
+// FITRIM is issued over ranges of this many bytes, so that a trim of a large,
+// fragmented filesystem stops soon after the deadline rather than running on.
+const uint64_t kTrimChunkBytes = 1ULL << 30;  // 1 GiB
+
+struct CheckpointMount {
+    std::string mount_point;
+    std::string blk_device;
+    bool is_blk_cp;
+    bool is_fs_cp;
+    bool ok = true;
+};
+
+// Trims a filesystem chunk by chunk until it is done or |deadline| passes.
+// Trimming is only an optimization for dm-bow, so stopping early is fine, but
+// a failed trim is reported so the mount is left out of the checkpoint as before.
+bool trimForCheckpoint(const std::string& mount_point,
+                       std::chrono::steady_clock::time_point deadline) {
+    android::base::unique_fd fd(
+            TEMP_FAILURE_RETRY(open(mount_point.c_str(), O_RDONLY | O_CLOEXEC)));
+    if (fd == -1) {
+        PLOG(ERROR) << "Failed to open mount point" << mount_point;
+        return false;
+    }
+
+    struct statvfs data;
+    if (fstatvfs(fd, &data) != 0) {
+        PLOG(ERROR) << "Failed to statvfs " << mount_point;
+        return false;
+    }
+    uint64_t size = (uint64_t)data.f_blocks * data.f_frsize;
+
+    nsecs_t start = systemTime(SYSTEM_TIME_BOOTTIME);
+    uint64_t trimmed = 0;
+    uint64_t offset = 0;
+    bool finished = false;
+    while (std::chrono::steady_clock::now() < deadline) {
+        struct fstrim_range range = {};
+        range.start = offset;
+        // The last chunk runs to the end, in case the filesystem reports less
+        // than its full size in f_blocks.
+        range.len = size - offset > kTrimChunkBytes ? kTrimChunkBytes : ULLONG_MAX;
+        if (ioctl(fd, FITRIM, &range)) {
+            PLOG(ERROR) << "Failed to trim " << mount_point << " at " << offset;
+            return false;
+        }
+        trimmed += range.len;
+        if (size - offset <= kTrimChunkBytes) {
+            finished = true;
+            break;
+        }
+        offset += kTrimChunkBytes;
+    }
+    nsecs_t time = systemTime(SYSTEM_TIME_BOOTTIME) - start;
+    if (finished) {
+        LOG(INFO) << "Trimmed " << trimmed << " bytes on " << mount_point << " in "
+                  << nanoseconds_to_milliseconds(time) << "ms for checkpoint";
+    } else {
+        LOG(WARNING) << "Trimmed " << trimmed << " bytes on " << mount_point << " in "
+                     << nanoseconds_to_milliseconds(time) << "ms for checkpoint, stopping at "
+                     << offset << " of " << size << " bytes on deadline";
+    }
+    return true;
+}
 }  // namespace
 
 Status cp_prepareCheckpoint() {
     // Log to notify CTS - see b/137924328 for context
     LOG(INFO) << "cp_prepareCheckpoint called";
-    std::lock_guard<std::mutex> lock(isCheckpointingLock);
-    if (!isCheckpointing) {
-        return Status::ok();
+    std::lock_guard<std::mutex> prepare_lock(prepareCheckpointLock);
+    {
+        std::lock_guard<std::mutex> lock(isCheckpointingLock);
+        if (!isCheckpointing) {
+            return Status::ok();
+        }
     }
 
     Fstab mounts;
@@ -375,37 +593,46 @@ Status cp_prepareCheckpoint() {
         return error(EINVAL, "Failed to get /proc/mounts");
     }
 
+    std::vector<CheckpointMount> cp_mounts;
     for (const auto& mount_rec : mounts) {
         const auto fstab_rec = GetEntryForMountPoint(&fstab_default, mount_rec.mount_point);
         if (!fstab_rec) continue;
+        if (!fstab_rec->fs_mgr_flags.checkpoint_blk && !fstab_rec->fs_mgr_flags.checkpoint_fs) {
+            continue;
+        }
+        CheckpointMount cp_mount;
+        cp_mount.mount_point = mount_rec.mount_point;
+        cp_mount.blk_device = mount_rec.blk_device;
+        cp_mount.is_blk_cp = fstab_rec->fs_mgr_flags.checkpoint_blk == 1;
+        cp_mount.is_fs_cp = fstab_rec->fs_mgr_flags.checkpoint_fs == 1;
+        cp_mounts.push_back(std::move(cp_mount));
+    }
 
-        if (fstab_rec->fs_mgr_flags.checkpoint_blk) {
-            android::base::unique_fd fd(
-                TEMP_FAILURE_RETRY(open(mount_rec.mount_point.c_str(), O_RDONLY | O_CLOEXEC)));
-            if (fd == -1) {
-                PLOG(ERROR) << "Failed to open mount point" << mount_rec.mount_point;
-                continue;
-            }
-
-            struct fstrim_range range = {};
-            range.len = ULLONG_MAX;
-            nsecs_t start = systemTime(SYSTEM_TIME_BOOTTIME);
-            if (ioctl(fd, FITRIM, &range)) {
-                PLOG(ERROR) << "Failed to trim " << mount_rec.mount_point;
-                continue;
-            }
-            nsecs_t time = systemTime(SYSTEM_TIME_BOOTTIME) - start;
-            LOG(INFO) << "Trimmed " << range.len << " bytes on " << mount_rec.mount_point << " in "
-                      << nanoseconds_to_milliseconds(time) << "ms for checkpoint";
+    // Trim the dm-bow devices in parallel, without holding isCheckpointingLock,
+    // so that one slow device neither delays the others nor blocks callers that
+    // only want to know whether we are checkpointing.
+    auto deadline = std::chrono::steady_clock::now() +
+                    std::chrono::milliseconds(GetUintProperty(
+                            kTrimTimeoutProp, trim_timeout_default, max_trim_timeout));
+    std::vector<std::thread> trims;
+    for (auto& cp_mount : cp_mounts) {
+        if (!cp_mount.is_blk_cp) continue;
+        trims.emplace_back([&cp_mount, deadline] {
+            cp_mount.ok = trimForCheckpoint(cp_mount.mount_point, deadline);
+        });
+    }
+    for (auto& trim : trims) trim.join();
 
-            isBow &= setBowState(mount_rec.blk_device, "1");
-        }
-        if (fstab_rec->fs_mgr_flags.checkpoint_blk || fstab_rec->fs_mgr_flags.checkpoint_fs) {
-            std::thread(cp_healthDaemon, std::string(mount_rec.mount_point),
-                        std::string(mount_rec.blk_device),
-                        fstab_rec->fs_mgr_flags.checkpoint_fs == 1)
-                .detach();
-        }
+    std::lock_guard<std::mutex> lock(isCheckpointingLock);
+    // The checkpoint may have been committed or aborted while we were trimming
+    if (!isCheckpointing) {
+        return Status::ok();
+    }
+    for (const auto& cp_mount : cp_mounts) {
+        if (!cp_mount.ok) continue;
+        if (cp_mount.is_blk_cp) isBow &= setBowState(cp_mount.blk_device, "1");
+        HealthMonitor::Instance().Add(cp_mount.mount_point, cp_mount.blk_device,
+                                      cp_mount.is_fs_cp);
     }
     return Status::ok();
 }
@@ -437,216 +664,528 @@ const int kMagic = 0x00574f42;
 // Partially restored MAGIC is WOB in ascii
 const int kPartialRestoreMagic = 0x00424f57;
 
-void crc32(const void* data, size_t n_bytes, uint32_t* crc) {
-    static uint32_t table[0x100] = {
-        0x00000000, 0x77073096, 0xEE0E612C, 0x990951BA, 0x076DC419, 0x706AF48F, 0xE963A535,
-        0x9E6495A3, 0x0EDB8832, 0x79DCB8A4, 0xE0D5E91E, 0x97D2D988, 0x09B64C2B, 0x7EB17CBD,
-        0xE7B82D07, 0x90BF1D91, 0x1DB71064, 0x6AB020F2, 0xF3B97148, 0x84BE41DE, 0x1ADAD47D,
-        0x6DDDE4EB, 0xF4D4B551, 0x83D385C7, 0x136C9856, 0x646BA8C0, 0xFD62F97A, 0x8A65C9EC,
-        0x14015C4F, 0x63066CD9, 0xFA0F3D63, 0x8D080DF5, 0x3B6E20C8, 0x4C69105E, 0xD56041E4,
-        0xA2677172, 0x3C03E4D1, 0x4B04D447, 0xD20D85FD, 0xA50AB56B, 0x35B5A8FA, 0x42B2986C,
-        0xDBBBC9D6, 0xACBCF940, 0x32D86CE3, 0x45DF5C75, 0xDCD60DCF, 0xABD13D59, 0x26D930AC,
-        0x51DE003A, 0xC8D75180, 0xBFD06116, 0x21B4F4B5, 0x56B3C423, 0xCFBA9599, 0xB8BDA50F,
-        0x2802B89E, 0x5F058808, 0xC60CD9B2, 0xB10BE924, 0x2F6F7C87, 0x58684C11, 0xC1611DAB,
-        0xB6662D3D,
-
-        0x76DC4190, 0x01DB7106, 0x98D220BC, 0xEFD5102A, 0x71B18589, 0x06B6B51F, 0x9FBFE4A5,
-        0xE8B8D433, 0x7807C9A2, 0x0F00F934, 0x9609A88E, 0xE10E9818, 0x7F6A0DBB, 0x086D3D2D,
-        0x91646C97, 0xE6635C01, 0x6B6B51F4, 0x1C6C6162, 0x856530D8, 0xF262004E, 0x6C0695ED,
-        0x1B01A57B, 0x8208F4C1, 0xF50FC457, 0x65B0D9C6, 0x12B7E950, 0x8BBEB8EA, 0xFCB9887C,
-        0x62DD1DDF, 0x15DA2D49, 0x8CD37CF3, 0xFBD44C65, 0x4DB26158, 0x3AB551CE, 0xA3BC0074,
-        0xD4BB30E2, 0x4ADFA541, 0x3DD895D7, 0xA4D1C46D, 0xD3D6F4FB, 0x4369E96A, 0x346ED9FC,
-        0xAD678846, 0xDA60B8D0, 0x44042D73, 0x33031DE5, 0xAA0A4C5F, 0xDD0D7CC9, 0x5005713C,
-        0x270241AA, 0xBE0B1010, 0xC90C2086, 0x5768B525, 0x206F85B3, 0xB966D409, 0xCE61E49F,
-        0x5EDEF90E, 0x29D9C998, 0xB0D09822, 0xC7D7A8B4, 0x59B33D17, 0x2EB40D81, 0xB7BD5C3B,
-        0xC0BA6CAD,
-
-        0xEDB88320, 0x9ABFB3B6, 0x03B6E20C, 0x74B1D29A, 0xEAD54739, 0x9DD277AF, 0x04DB2615,
-        0x73DC1683, 0xE3630B12, 0x94643B84, 0x0D6D6A3E, 0x7A6A5AA8, 0xE40ECF0B, 0x9309FF9D,
-        0x0A00AE27, 0x7D079EB1, 0xF00F9344, 0x8708A3D2, 0x1E01F268, 0x6906C2FE, 0xF762575D,
-        0x806567CB, 0x196C3671, 0x6E6B06E7, 0xFED41B76, 0x89D32BE0, 0x10DA7A5A, 0x67DD4ACC,
-        0xF9B9DF6F, 0x8EBEEFF9, 0x17B7BE43, 0x60B08ED5, 0xD6D6A3E8, 0xA1D1937E, 0x38D8C2C4,
-        0x4FDFF252, 0xD1BB67F1, 0xA6BC5767, 0x3FB506DD, 0x48B2364B, 0xD80D2BDA, 0xAF0A1B4C,
-        0x36034AF6, 0x41047A60, 0xDF60EFC3, 0xA867DF55, 0x316E8EEF, 0x4669BE79, 0xCB61B38C,
-        0xBC66831A, 0x256FD2A0, 0x5268E236, 0xCC0C7795, 0xBB0B4703, 0x220216B9, 0x5505262F,
-        0xC5BA3BBE, 0xB2BD0B28, 0x2BB45A92, 0x5CB36A04, 0xC2D7FFA7, 0xB5D0CF31, 0x2CD99E8B,
-        0x5BDEAE1D,
-
-        0x9B64C2B0, 0xEC63F226, 0x756AA39C, 0x026D930A, 0x9C0906A9, 0xEB0E363F, 0x72076785,
-        0x05005713, 0x95BF4A82, 0xE2B87A14, 0x7BB12BAE, 0x0CB61B38, 0x92D28E9B, 0xE5D5BE0D,
-        0x7CDCEFB7, 0x0BDBDF21, 0x86D3D2D4, 0xF1D4E242, 0x68DDB3F8, 0x1FDA836E, 0x81BE16CD,
-        0xF6B9265B, 0x6FB077E1, 0x18B74777, 0x88085AE6, 0xFF0F6A70, 0x66063BCA, 0x11010B5C,
-        0x8F659EFF, 0xF862AE69, 0x616BFFD3, 0x166CCF45, 0xA00AE278, 0xD70DD2EE, 0x4E048354,
-        0x3903B3C2, 0xA7672661, 0xD06016F7, 0x4969474D, 0x3E6E77DB, 0xAED16A4A, 0xD9D65ADC,
-        0x40DF0B66, 0x37D83BF0, 0xA9BCAE53, 0xDEBB9EC5, 0x47B2CF7F, 0x30B5FFE9, 0xBDBDF21C,
-        0xCABAC28A, 0x53B39330, 0x24B4A3A6, 0xBAD03605, 0xCDD70693, 0x54DE5729, 0x23D967BF,
-        0xB3667A2E, 0xC4614AB8, 0x5D681B02, 0x2A6F2B94, 0xB40BBE37, 0xC30C8EA1, 0x5A05DF1B,
-        0x2D02EF8D};
-
-    for (size_t i = 0; i < n_bytes; ++i) {
-        *crc ^= ((uint8_t*)data)[i];
-        *crc = table[(uint8_t)*crc] ^ *crc >> 8;
+// How much of the data checked during validation to keep for the restore.
+const size_t kMaxValidatedBytes = 32 * 1024 * 1024;
+
+// The stats of the last restore, for cp_getRestoreStats().
+std::mutex restoreStatsLock;
+CheckpointRestoreStats restoreStats;
+
+// A function from sectors to values that is constant over runs of sectors.  It
+// is stored as the sorted list of the sectors that start a run, each with the
+// value of its run.  Sector 0 always starts a run, and adjacent runs always have
+// different values.
+//
+// The runs are kept in contiguous blocks of up to kMaxBlockRuns entries rather
+// than in a tree, so that a lookup is two binary searches over arrays, and an
+// update moves a few hundred entries instead of allocating and freeing nodes.
+template <typename V>
+class SectorMap {
+  public:
+    explicit SectorMap(V initial) { Reset(initial); }
+
+    // Sets every sector to |initial|.
+    void Reset(V initial) {
+        blocks_.resize(1);
+        blocks_[0].assign(1, {0, initial});
+        block_starts_.assign(1, 0);
+    }
+
+    V Get(sector_t sector) const {
+        const auto& block = blocks_[FindBlock(sector)];
+        return block[FindRun(block, sector)].value;
+    }
+
+    // Calls |fn(start, end, value)| for each run that overlaps [begin, end),
+    // with the run clipped to [begin, end).  Stops early if |fn| returns false.
+    template <typename Fn>
+    void ForEachRun(sector_t begin, sector_t end, Fn fn) const {
+        size_t b = FindBlock(begin);
+        size_t r = FindRun(blocks_[b], begin);
+        for (; b < blocks_.size(); b++, r = 0) {
+            for (; r < blocks_[b].size(); r++) {
+                const Run& run = blocks_[b][r];
+                if (run.start >= end) return;
+                sector_t run_end = end;
+                if (r + 1 < blocks_[b].size())
+                    run_end = std::min(end, blocks_[b][r + 1].start);
+                else if (b + 1 < blocks_.size())
+                    run_end = std::min(end, block_starts_[b + 1]);
+                if (!fn(std::max(run.start, begin), run_end, run.value)) return;
+            }
+        }
+    }
+
+    // Sets the sectors in [begin, end) to |value|.
+    void Set(sector_t begin, sector_t end, V value) {
+        new_runs_.assign(1, {begin, value});
+        Replace(begin, end);
+    }
+
+    // Sets sector |dest| + i to |fn(value of sector source + i)| for each i in
+    // [0, count).
+    template <typename Fn>
+    void CopyRange(sector_t dest, sector_t source, sector_t count, Fn fn) {
+        new_runs_.clear();
+        ForEachRun(source, source + count, [&](sector_t start, sector_t, V value) {
+            new_runs_.push_back({dest + start - source, fn(value)});
+            return true;
+        });
+        Replace(dest, dest + count);
+    }
+
+  private:
+    struct Run {
+        sector_t start;
+        V value;
+    };
+
+    static constexpr size_t kMaxBlockRuns = 512;
+
+    // Returns the index of the block holding the run that contains |sector|.
+    size_t FindBlock(sector_t sector) const {
+        return std::upper_bound(block_starts_.begin(), block_starts_.end(), sector) -
+               block_starts_.begin() - 1;
+    }
+
+    static size_t FindRun(const std::vector<Run>& block, sector_t sector) {
+        return std::upper_bound(block.begin(), block.end(), sector,
+                                [](sector_t s, const Run& run) { return s < run.start; }) -
+               block.begin() - 1;
+    }
+
+    // Replaces the runs in [begin, end) with new_runs_, whose first run must
+    // start at |begin|.  The sectors from |end| on keep their values.
+    void Replace(sector_t begin, sector_t end) {
+        V end_value = Get(end);
+
+        // Usually the change is in the middle of a single block, and can be
+        // made in place.
+        size_t b = FindBlock(begin);
+        auto& block = blocks_[b];
+        auto by_start = [](const Run& run, sector_t s) { return run.start < s; };
+        size_t lo = std::lower_bound(block.begin(), block.end(), begin, by_start) - block.begin();
+        size_t hi = FindRun(block, end) + 1;
+        if (lo > 0 && (hi < block.size() || b == blocks_.size() - 1)) {
+            new_runs_.push_back({end, end_value});
+            flat_.clear();
+            V prev = block[lo - 1].value;
+            for (const Run& run : new_runs_) {
+                if (run.value != prev) flat_.push_back(run);
+                prev = run.value;
+            }
+            // Merge the run after |end| into the new runs if it has the same value.
+            if (hi < block.size() && block[hi].value == prev) hi++;
+
+            block.erase(block.begin() + lo, block.begin() + hi);
+            block.insert(block.begin() + lo, flat_.begin(), flat_.end());
+            if (block.size() > kMaxBlockRuns) {
+                std::vector<Run> upper(block.begin() + block.size() / 2, block.end());
+                block.resize(block.size() / 2);
+                block_starts_.insert(block_starts_.begin() + b + 1, upper.front().start);
+                blocks_.insert(blocks_.begin() + b + 1, std::move(upper));
+            }
+            return;
+        }
+
+        // Otherwise, rebuild the blocks from the one holding the last run before |begin|
+        // to the one holding the first run after |end|, so that the new runs
+        // can be merged with their neighbours.
+        size_t first = FindBlock(begin == 0 ? 0 : begin - 1);
+        size_t last = std::min(FindBlock(end) + 1, blocks_.size() - 1);
+
+        flat_.clear();
+        auto append = [this](const Run& run) {
+            if (flat_.empty() || flat_.back().value != run.value) flat_.push_back(run);
+        };
+        for (size_t b = first; b <= last; b++) {
+            for (const Run& run : blocks_[b]) {
+                if (run.start < begin) append(run);
+            }
+        }
+        for (const Run& run : new_runs_) append(run);
+        append({end, end_value});
+        for (size_t b = first; b <= last; b++) {
+            for (const Run& run : blocks_[b]) {
+                if (run.start > end) append(run);
+            }
+        }
+
+        // Split the result into blocks that are half full, so that the next
+        // few updates don't have to split them again.
+        size_t old_blocks = last - first + 1;
+        size_t new_blocks =
+                flat_.size() <= kMaxBlockRuns ? 1 : (flat_.size() * 2 - 1) / kMaxBlockRuns + 1;
+        if (new_blocks > old_blocks) {
+            blocks_.insert(blocks_.begin() + last + 1, new_blocks - old_blocks, {});
+            block_starts_.insert(block_starts_.begin() + last + 1, new_blocks - old_blocks, 0);
+        } else {
+            blocks_.erase(blocks_.begin() + first + new_blocks, blocks_.begin() + last + 1);
+            block_starts_.erase(block_starts_.begin() + first + new_blocks,
+                                block_starts_.begin() + last + 1);
+        }
+        for (size_t i = 0; i < new_blocks; i++) {
+            auto lo = flat_.begin() + flat_.size() * i / new_blocks;
+            auto hi = flat_.begin() + flat_.size() * (i + 1) / new_blocks;
+            blocks_[first + i].assign(lo, hi);
+            block_starts_[first + i] = lo->start;
+        }
     }
-}
+
+    std::vector<std::vector<Run>> blocks_;
+    // The start of the first run of each block.
+    std::vector<sector_t> block_starts_;
+    // Scratch space for updates.
+    std::vector<Run> new_runs_;
+    std::vector<Run> flat_;
+};
 
 // A map of relocations.
-// The map must be initialized so that relocations[0] = 0
 // During restore, we replay the log records in reverse, copying from dest to
 // source
 // To validate, we must be able to read the 'dest' sectors as though they had
 // been copied but without actually copying. This map represents how the sectors
-// would have been moved. To read a sector s, find the index <= s and read
-// relocations[index] + s - index
-typedef std::map<sector_t, sector_t> Relocations;
+// would have been moved: sector s is read from sector s + relocations.Get(s),
+// using unsigned wraparound for sectors that move down.
+typedef SectorMap<sector_t> Relocations;
 
 void relocate(Relocations& relocations, sector_t dest, sector_t source, int count) {
-    // Find first one we're equal to or greater than
-    auto s = --relocations.upper_bound(source);
-
-    // Take slice
-    Relocations slice;
-    slice[dest] = source - s->first + s->second;
-    ++s;
-
-    // Add rest of elements
-    for (; s != relocations.end() && s->first < source + count; ++s)
-        slice[dest - source + s->first] = s->second;
-
-    // Split range at end of dest
-    auto dest_end = --relocations.upper_bound(dest + count);
-    relocations[dest + count] = dest + count - dest_end->first + dest_end->second;
-
-    // Remove all elements in [dest, dest + count)
-    relocations.erase(relocations.lower_bound(dest), relocations.lower_bound(dest + count));
-
-    // Add new elements
-    relocations.insert(slice.begin(), slice.end());
+    relocations.CopyRange(dest, source, count,
+                          [dest, source](sector_t offset) { return offset + source - dest; });
 }
 
 // A map of sectors that have been written to.
-// The final entry must always be False.
 // When we restart the restore after an interruption, we must take care that
 // when we copy from dest to source, that the block we copy to was not
 // previously copied from.
 // i e. A->B C->A; If we replay this sequence, we end up copying C->B
 // We must save our partial result whenever we finish a page, or when we copy
 // to a location that was copied from earlier (our source is an earlier dest)
-typedef std::map<sector_t, bool> Used_Sectors;
+typedef SectorMap<bool> Used_Sectors;
 
 bool checkCollision(Used_Sectors& used_sectors, sector_t start, sector_t end) {
-    auto second_overlap = used_sectors.upper_bound(start);
-    auto first_overlap = --second_overlap;
-
-    if (first_overlap->second) {
-        return true;
-    } else if (second_overlap != used_sectors.end() && second_overlap->first < end) {
-        return true;
-    }
-    return false;
+    bool collision = false;
+    used_sectors.ForEachRun(start, end, [&collision](sector_t, sector_t, bool used) {
+        collision = used;
+        return !collision;
+    });
+    return collision;
 }
 
 void markUsed(Used_Sectors& used_sectors, sector_t start, sector_t end) {
-    auto start_pos = used_sectors.insert_or_assign(start, true).first;
-    auto end_pos = used_sectors.insert_or_assign(end, false).first;
+    used_sectors.Set(start, end, true);
+}
 
-    if (start_pos == used_sectors.begin() || !std::prev(start_pos)->second) {
-        start_pos++;
+// Collects the writes of a restore, so that writes to adjacent sectors can be
+// issued together with pwritev().  A queued write must be flushed before
+// anything that depends on it: a read of an overlapping range, or an fsync.
+class WriteBatch {
+  public:
+    explicit WriteBatch(CheckpointDevice* device) : device_(device) {}
+
+    bool Empty() const { return writes_.empty(); }
+    uint64_t bytes_written() const { return bytes_written_; }
+
+    bool Overlaps(sector_t start, sector_t end) const {
+        // Queued writes never overlap, so the one that starts last before |end|
+        // is also the one that ends last.
+        auto it = writes_.lower_bound(end);
+        if (it == writes_.begin()) return false;
+        --it;
+        return it->first + (it->second.size - 1) / kSectorSize + 1 > start;
     }
-    if (std::next(end_pos) != used_sectors.end() && !std::next(end_pos)->second) {
-        end_pos++;
+
+    // Queues a write of |size| bytes from |data| to |sector|.  Earlier writes
+    // are flushed first if they overlap it, or if the batch is full.
+    bool Add(sector_t sector, const char* data, uint32_t size) {
+        if ((Overlaps(sector, sector + (size - 1) / kSectorSize + 1) ||
+             data_.size() + size > kMaxBatchBytes) &&
+            !Flush()) {
+            return false;
+        }
+        writes_[sector] = {data_.size(), size};
+        data_.insert(data_.end(), data, data + size);
+        return true;
     }
-    if (start_pos->first < end_pos->first) {
-        used_sectors.erase(start_pos, end_pos);
+
+    // Issues the queued writes in order of sector, with one pwritev() for each
+    // run of contiguous writes.
+    bool Flush() {
+        bool success = true;
+        for (auto it = writes_.begin(); it != writes_.end() && success;) {
+            off64_t offset = it->first * kSectorSize;
+            off64_t next = offset;
+            iov_.clear();
+            for (; it != writes_.end() && it->first * kSectorSize == (sector_t)next &&
+                   iov_.size() < IOV_MAX;
+                 ++it) {
+                iov_.push_back({&data_[it->second.offset], it->second.size});
+                next += it->second.size;
+            }
+            if (!device_->Write(iov_.data(), iov_.size(), offset)) {
+                PLOG(ERROR) << "Failed to write " << next - offset << " bytes at " << offset;
+                success = false;
+            } else {
+                bytes_written_ += next - offset;
+            }
+        }
+        writes_.clear();
+        data_.clear();
+        return success;
     }
-}
 
-// Restores the given log_entry's data from dest -> source
-// If that entry is a log sector, set the magic to kPartialRestoreMagic and flush.
-void restoreSector(int device_fd, Used_Sectors& used_sectors, std::vector<char>& ls_buffer,
-                   log_entry* le, std::vector<char>& buffer) {
-    log_sector_v1_0& ls = *reinterpret_cast<log_sector_v1_0*>(&ls_buffer[0]);
-    uint32_t index = le - ((log_entry*)&ls_buffer[ls.header_size]);
-    int count = (le->size - 1) / kSectorSize + 1;
-
-    if (checkCollision(used_sectors, le->source, le->source + count)) {
-        fsync(device_fd);
-        lseek64(device_fd, 0, SEEK_SET);
-        ls.count = index + 1;
-        ls.magic = kPartialRestoreMagic;
-        write(device_fd, &ls_buffer[0], ls.block_size);
-        fsync(device_fd);
-        used_sectors.clear();
-        used_sectors[0] = false;
+  private:
+    struct Write {
+        size_t offset;  // in data_
+        uint32_t size;
+    };
+
+    static constexpr size_t kMaxBatchBytes = 4 * 1024 * 1024;
+
+    CheckpointDevice* device_;
+    // By sector
+    std::map<sector_t, Write> writes_;
+    std::vector<char> data_;
+    std::vector<iovec> iov_;
+    uint64_t bytes_written_ = 0;
+};
+
+// Writes restored data back, keeping sector 0 a valid point to restart from.
+//
+// Sector 0 holds the log sector being restored, marked kPartialRestoreMagic and
+// with the number of its entries still to restore.  An interrupted restore
+// starts again from whatever marker is on the device and reads the dest of
+// every entry from there on, so:
+//  - a marker is written only once every earlier write is on the device;
+//  - a write to a sector read since the last marker needs a new marker first,
+//    the collisions described above; and
+//  - a write to a sector read since the last marker known to be on the device
+//    must wait for an fsync.
+// The last rule is what lets the restore move on to the next log sector without
+// waiting for the marker written by entry 0, as most writes of the next log
+// sector don't touch the sectors the previous one read.
+class RestoreWriter {
+  public:
+    RestoreWriter(CheckpointDevice* device, CheckpointRestoreStats* stats)
+        : device_(device),
+          stats_(stats),
+          batch_(device),
+          since_marker_(false),
+          since_synced_marker_(false) {}
+
+    // Must be called before reading |start| to |end|, so the read sees queued writes.
+    bool PrepareRead(sector_t start, sector_t end) {
+        return !batch_.Overlaps(start, end) || batch_.Flush();
     }
 
-    markUsed(used_sectors, le->dest, le->dest + count);
+    // Must be called before restoring the log sector in |ls_buffer|.
+    bool StartLogSector(std::vector<char>& ls_buffer) {
+        log_sector_v1_0& ls = *reinterpret_cast<log_sector_v1_0*>(&ls_buffer[0]);
+        if (ls.magic != kMagic) return true;
+        // Sector 0 must say that the restore has started before anything is
+        // written, or an interrupted restore would be validated again.
+        return Mark(ls_buffer, ls.count) && Sync();
+    }
 
-    if (index == 0 && ls.sequence != 0) {
-        log_sector_v1_0* next = reinterpret_cast<log_sector_v1_0*>(&buffer[0]);
-        if (next->magic == kMagic) {
-            next->magic = kPartialRestoreMagic;
+    // Restores the given log_entry's data from dest -> source, from |buffer|.
+    // If that entry is a log sector, sets the magic to kPartialRestoreMagic.
+    bool Restore(std::vector<char>& ls_buffer, log_entry* le, std::vector<char>& buffer) {
+        log_sector_v1_0& ls = *reinterpret_cast<log_sector_v1_0*>(&ls_buffer[0]);
+        uint32_t index = le - ((log_entry*)&ls_buffer[ls.header_size]);
+        int count = (le->size - 1) / kSectorSize + 1;
+
+        // Move the marker up to this entry whenever there is a collision, and
+        // whenever this write has to wait for an fsync anyway, so that an
+        // interrupted restore doesn't repeat the writes that are already on
+        // the device.  Also do so after every kMaxUnmarkedBytes of writes, to
+        // bound how much is repeated.
+        bool collision = checkCollision(since_marker_, le->source, le->source + count);
+        bool needs_sync = checkCollision(since_synced_marker_, le->source, le->source + count);
+        if ((collision || needs_sync || unmarked_bytes_ >= kMaxUnmarkedBytes) &&
+            !Mark(ls_buffer, index + 1)) {
+            return false;
+        }
+        if (collision && !Sync()) return false;
+        markUsed(since_marker_, le->dest, le->dest + count);
+        markUsed(since_synced_marker_, le->dest, le->dest + count);
+
+        if (index == 0 && ls.sequence != 0) {
+            log_sector_v1_0* next = reinterpret_cast<log_sector_v1_0*>(&buffer[0]);
+            if (next->magic == kMagic) {
+                next->magic = kPartialRestoreMagic;
+            }
         }
-    }
 
-    lseek64(device_fd, le->source * kSectorSize, SEEK_SET);
-    write(device_fd, &buffer[0], le->size);
+        // Entry 0 overwrites sector 0, so every other write of this log sector
+        // must be on the device before it is.
+        if (index == 0 && !Sync()) return false;
 
-    if (index == 0) {
-        fsync(device_fd);
-    }
-}
+        if (!batch_.Add(le->source, &buffer[0], le->size)) return false;
+        unmarked_bytes_ += le->size;
 
-// Read from the device
-// If we are validating, the read occurs as though the relocations had happened
-// returns the amount asked for or an empty buffer on error. Partial reads are considered a failure
-std::vector<char> relocatedRead(int device_fd, Relocations const& relocations, bool validating,
-                                sector_t sector, uint32_t size, uint32_t block_size) {
-    if (!validating) {
-        std::vector<char> buffer(size);
-        off64_t offset = sector * kSectorSize;
-        if (lseek64(device_fd, offset, SEEK_SET) != offset) {
-            return std::vector<char>();
+        if (index == 0) {
+            if (!batch_.Flush()) return false;
+            if (ls.sequence != 0) {
+                stats_->markers++;
+                marker_pending_ = true;
+                since_marker_.Reset(false);
+                unmarked_bytes_ = 0;
+            }
         }
-        if (read(device_fd, &buffer[0], size) != static_cast<ssize_t>(size)) {
-            return std::vector<char>();
+        return true;
+    }
+
+    // Records in sector 0 that the log sector in |ls_buffer| has |count| entries
+    // left to restore.
+    bool Mark(std::vector<char>& ls_buffer, uint32_t count) {
+        log_sector_v1_0& ls = *reinterpret_cast<log_sector_v1_0*>(&ls_buffer[0]);
+        if (!Sync()) return false;
+        ls.count = count;
+        ls.magic = kPartialRestoreMagic;
+        struct iovec iov = {&ls_buffer[0], ls.block_size};
+        if (!device_->Write(&iov, 1, 0)) {
+            PLOG(ERROR) << "Failed to write log sector";
+            return false;
         }
-        return buffer;
+        stats_->bytes_written += ls.block_size;
+        stats_->markers++;
+        dirty_ = true;
+        marker_pending_ = true;
+        since_marker_.Reset(false);
+        unmarked_bytes_ = 0;
+        return true;
     }
 
-    std::vector<char> buffer(size);
-    for (uint32_t i = 0; i < size; i += block_size, sector += block_size / kSectorSize) {
-        auto relocation = --relocations.upper_bound(sector);
-        off64_t offset = (sector + relocation->second - relocation->first) * kSectorSize;
-        if (lseek64(device_fd, offset, SEEK_SET) != offset) {
-            return std::vector<char>();
+    // Writes everything queued and waits for it to reach the device.
+    bool Sync() {
+        if (!batch_.Empty() && !batch_.Flush()) return false;
+        // The batch also flushes itself, before an overlapping read or write
+        // and when it is full.
+        if (batch_.bytes_written() != synced_batch_bytes_) dirty_ = true;
+        if (!dirty_) return true;
+        if (!device_->Sync()) {
+            PLOG(ERROR) << "Failed to fsync";
+            return false;
         }
-        if (read(device_fd, &buffer[i], block_size) != static_cast<ssize_t>(block_size)) {
-            return std::vector<char>();
+        stats_->fsyncs++;
+        dirty_ = false;
+        synced_batch_bytes_ = batch_.bytes_written();
+        if (marker_pending_) {
+            since_synced_marker_ = since_marker_;
+            marker_pending_ = false;
         }
+        return true;
+    }
+
+    ~RestoreWriter() {
+        stats_->bytes_written += batch_.bytes_written();
+        stats_->bytes_relocated += batch_.bytes_written();
+    }
+
+  private:
+    CheckpointDevice* device_;
+    CheckpointRestoreStats* stats_;
+    WriteBatch batch_;
+    // The dests read since the last marker was written, and since the last
+    // marker that is known to be on the device.
+    Used_Sectors since_marker_;
+    Used_Sectors since_synced_marker_;
+    // Whether a marker has been written since the last fsync.  Writes of the
+    // batch are noticed by the growth of its bytes_written().
+    bool dirty_ = false;
+    uint64_t synced_batch_bytes_ = 0;
+    // Whether a marker has been written since the last fsync.
+    bool marker_pending_ = false;
+    // How much has been written since the last marker.
+    uint64_t unmarked_bytes_ = 0;
+
+    static constexpr uint64_t kMaxUnmarkedBytes = 64 * 1024 * 1024;
+};
+
+// Read from the device into |buffer|
+// If we are validating, the read occurs as though the relocations had happened,
+// with one read for each run of sectors that is contiguous on the device.
+// Returns false on error. Partial reads are considered a failure
+bool relocatedRead(CheckpointDevice* device, Relocations const& relocations, bool validating,
+                   sector_t sector, uint32_t size, std::vector<char>* buffer) {
+    buffer->resize(size);
+    if (!validating) {
+        return device->Read(buffer->data(), size, sector * kSectorSize);
     }
 
-    return buffer;
+    bool success = true;
+    relocations.ForEachRun(sector, sector + (size - 1) / kSectorSize + 1,
+                           [&](sector_t start, sector_t end, sector_t offset) {
+                               size_t pos = (start - sector) * kSectorSize;
+                               size_t bytes = std::min<size_t>((end - start) * kSectorSize,
+                                                               size - pos);
+                               success = device->Read(buffer->data() + pos, bytes,
+                                                      (start + offset) * kSectorSize);
+                               return success;
+                           });
+    return success;
 }
 
+// A CheckpointDevice on a block device opened by cp_restoreCheckpoint().
+class FdCheckpointDevice : public CheckpointDevice {
+  public:
+    explicit FdCheckpointDevice(base::unique_fd fd) : fd_(std::move(fd)) {}
+
+    bool Read(void* data, size_t size, uint64_t offset) override {
+        return pread64(fd_, data, size, offset) == static_cast<ssize_t>(size);
+    }
+
+    bool Write(const struct iovec* iov, int iovcnt, uint64_t offset) override {
+        size_t size = 0;
+        for (int i = 0; i < iovcnt; i++) size += iov[i].iov_len;
+        return pwritev64(fd_, iov, iovcnt, offset) == static_cast<ssize_t>(size);
+    }
+
+    bool Sync() override { return fsync(fd_) == 0; }
+
+  private:
+    base::unique_fd fd_;
+};
+
 }  // namespace
 
 Status cp_restoreCheckpoint(const std::string& blockDevice, int restore_limit) {
+    base::unique_fd device_fd(open(blockDevice.c_str(), O_RDWR | O_CLOEXEC));
+    if (device_fd < 0) return error("Cannot open " + blockDevice);
+    FdCheckpointDevice device(std::move(device_fd));
+    return cp_restoreCheckpoint(&device, blockDevice, restore_limit);
+}
+
+Status cp_restoreCheckpoint(CheckpointDevice* device, const std::string& blockDevice,
+                            int restore_limit) {
     bool validating = true;
     std::string action = "Validating";
     int restore_count = 0;
+    CheckpointRestoreStats stats;
+    stats.device = blockDevice;
+    auto start_time = std::chrono::steady_clock::now();
+    auto elapsed_ms = [&start_time] {
+        auto now = std::chrono::steady_clock::now();
+        auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(now - start_time);
+        start_time = now;
+        return ms.count();
+    };
+
+    // The data of the entries checked during validation, in the order the
+    // restore will need it.  Restoring from these saves reading and checking
+    // the data a second time.
+    std::vector<std::vector<char>> validated;
+    size_t validated_bytes = 0;
+    size_t restored_entries = 0;
 
     for (;;) {
-        Relocations relocations;
-        relocations[0] = 0;
+        Relocations relocations(0);
         Status status = Status::ok();
 
         LOG(INFO) << action << " checkpoint on " << blockDevice;
-        base::unique_fd device_fd(open(blockDevice.c_str(), O_RDWR | O_CLOEXEC));
-        if (device_fd < 0) return error("Cannot open " + blockDevice);
 
         log_sector_v1_0 original_ls;
-        if (read(device_fd, reinterpret_cast<char*>(&original_ls), sizeof(original_ls)) !=
-            sizeof(original_ls)) {
+        if (!device->Read(&original_ls, sizeof(original_ls), 0)) {
             return error(EINVAL, "Cannot read sector");
         }
         if (original_ls.magic == kPartialRestoreMagic) {
@@ -661,19 +1200,23 @@ Status cp_restoreCheckpoint(const std::string& blockDevice, int restore_limit) {
         }
 
         LOG(INFO) << action << " " << original_ls.sequence << " log sectors";
+        stats.log_sectors = original_ls.sequence + 1;
+
+        // Reused for each log sector and log entry.
+        std::vector<char> ls_buffer;
+        std::vector<char> buffer;
+        std::optional<RestoreWriter> writer;
+        if (!validating) writer.emplace(device, &stats);
 
         for (int sequence = original_ls.sequence; sequence >= 0 && status.isOk(); sequence--) {
-            auto ls_buffer = relocatedRead(device_fd, relocations, validating, 0,
-                                           original_ls.block_size, original_ls.block_size);
-            if (ls_buffer.size() != original_ls.block_size) {
+            if (!relocatedRead(device, relocations, validating, 0, original_ls.block_size,
+                               &ls_buffer)) {
                 status = error(EINVAL, "Failed to read log sector");
                 break;
             }
+            stats.bytes_read += ls_buffer.size();
             log_sector_v1_0& ls = *reinterpret_cast<log_sector_v1_0*>(&ls_buffer[0]);
 
-            Used_Sectors used_sectors;
-            used_sectors[0] = false;
-
             if (ls.magic != kMagic && (ls.magic != kPartialRestoreMagic || validating)) {
                 status = error(EINVAL, "No magic");
                 break;
@@ -699,6 +1242,10 @@ Status cp_restoreCheckpoint(const std::string& blockDevice, int restore_limit) {
                 break;
             }
             LOG(INFO) << action << " from log sector " << ls.sequence;
+            if (!validating && !writer->StartLogSector(ls_buffer)) {
+                status = error(EIO, "Failed to write sector");
+                break;
+            }
             for (log_entry* le =
                      reinterpret_cast<log_entry*>(&ls_buffer[ls.header_size]) + ls.count - 1;
                  le >= reinterpret_cast<log_entry*>(&ls_buffer[ls.header_size]); --le) {
@@ -711,28 +1258,61 @@ Status cp_restoreCheckpoint(const std::string& blockDevice, int restore_limit) {
                     status = error(EINVAL, "log entry is invalid");
                     break;
                 }
-                auto buffer = relocatedRead(device_fd, relocations, validating, le->dest, le->size,
-                                            ls.block_size);
-                if (buffer.size() != le->size) {
-                    status = error(EINVAL, "Failed to read sector");
-                    break;
-                }
-                uint32_t checksum = le->source / (ls.block_size / kSectorSize);
-                for (size_t i = 0; i < le->size; i += ls.block_size) {
-                    crc32(&buffer[i], ls.block_size, &checksum);
-                }
+                sector_t dest_end = le->dest + (le->size - 1) / kSectorSize + 1;
+                stats.log_entries++;
 
-                if (le->checksum && checksum != le->checksum) {
-                    status = error(EINVAL, "Checksums don't match");
-                    break;
+                if (!validating && restored_entries < validated.size()) {
+                    // Checked already.
+                    buffer.swap(validated[restored_entries]);
+                    stats.bytes_reused += buffer.size();
+                } else {
+                    // The data must be read after any queued write to it.
+                    if (!validating && !writer->PrepareRead(le->dest, dest_end)) {
+                        status = error(EIO, "Failed to write sector");
+                        break;
+                    }
+                    if (!relocatedRead(device, relocations, validating, le->dest, le->size,
+                                       &buffer)) {
+                        status = error(EINVAL, "Failed to read sector");
+                        break;
+                    }
+                    stats.bytes_read += le->size;
+                    uint32_t checksum = le->source / (ls.block_size / kSectorSize);
+                    for (size_t i = 0; i < le->size; i += ls.block_size) {
+                        crc32(&buffer[i], ls.block_size, &checksum);
+                    }
+
+                    if (le->checksum && checksum != le->checksum) {
+                        status = error(EINVAL, "Checksums don't match");
+                        break;
+                    }
                 }
 
                 if (validating) {
+                    // Sector 0 is read differently by the restore, which marks
+                    // the log sectors it writes there as partially restored.
+                    if (validated.size() == stats.log_entries - 1 &&
+                        validated_bytes + le->size <= kMaxValidatedBytes &&
+                        le->dest >= ls.block_size / kSectorSize) {
+                        validated.push_back(buffer);
+                        validated_bytes += le->size;
+                    }
                     relocate(relocations, le->source, le->dest, (le->size - 1) / kSectorSize + 1);
                 } else {
-                    restoreSector(device_fd, used_sectors, ls_buffer, le, buffer);
+                    restored_entries++;
+                    if (!writer->Restore(ls_buffer, le, buffer)) {
+                        status = error(EIO, "Failed to write sector");
+                        break;
+                    }
                     restore_count++;
                     if (restore_limit && restore_count >= restore_limit) {
+                        // Save the progress so that the next call continues from here.  The
+                        // last entry of a log sector already did.
+                        uint32_t index = le - reinterpret_cast<log_entry*>(&ls_buffer[ls.header_size]);
+                        if ((index > 0 && !writer->Mark(ls_buffer, index)) || !writer->Sync()) {
+                            status = error(EIO, "Failed to save restore progress");
+                            break;
+                        }
                         status = error(EAGAIN, "Hit the test limit");
                         break;
                     }
@@ -740,6 +1320,27 @@ Status cp_restoreCheckpoint(const std::string& blockDevice, int restore_limit) {
             }
         }
 
+        if (status.isOk() && !validating && !writer->Sync()) {
+            status = error(EIO, "Failed to write sector");
+        }
+        writer.reset();
+
+        if (validating) {
+            stats.validate_ms = elapsed_ms();
+        } else {
+            stats.restore_ms = elapsed_ms();
+            LOG(INFO) << "Checkpoint restore of " << stats.log_sectors << " log sectors and "
+                      << stats.log_entries << " entries took " << stats.validate_ms << " + "
+                      << stats.restore_ms << " ms: read " << stats.bytes_read << " bytes, reused "
+                      << stats.bytes_reused << " validated bytes, wrote " << stats.bytes_written
+                      << " bytes of which " << stats.bytes_relocated << " relocated, "
+                      << stats.markers << " markers, " << stats.fsyncs << " fsyncs";
+        }
+        {
+            std::lock_guard<std::mutex> lock(restoreStatsLock);
+            restoreStats = stats;
+        }
+
         if (!status.isOk()) {
             if (!validating) {
                 LOG(ERROR) << "Checkpoint restore failed even though checkpoint validation passed";
@@ -747,17 +1348,13 @@ Status cp_restoreCheckpoint(const std::string& blockDevice, int restore_limit) {
             }
 
             LOG(WARNING) << "Checkpoint validation failed - attempting to roll forward";
-            auto buffer = relocatedRead(device_fd, relocations, false, original_ls.sector0,
-                                        original_ls.block_size, original_ls.block_size);
-            if (buffer.size() != original_ls.block_size) {
+            if (!relocatedRead(device, relocations, false, original_ls.sector0,
+                               original_ls.block_size, &buffer)) {
                 return error(EINVAL, "Failed to read original sector");
             }
 
-            if (lseek64(device_fd, 0, SEEK_SET) != 0) {
-                return error(EINVAL, "Failed to seek to sector 0");
-            }
-            if (write(device_fd, &buffer[0], original_ls.block_size) !=
-                static_cast<ssize_t>(original_ls.block_size)) {
+            struct iovec iov = {&buffer[0], original_ls.block_size};
+            if (!device->Write(&iov, 1, 0)) {
                 return error(EINVAL, "Failed to write original sector");
             }
             return Status::ok();
@@ -767,11 +1364,25 @@ Status cp_restoreCheckpoint(const std::string& blockDevice, int restore_limit) {
 
         validating = false;
         action = "Restoring";
+        stats.log_entries = 0;
     }
 
     return Status::ok();
 }
 
+std::vector<CheckpointHealth> cp_getHealth() {
+    return HealthMonitor::Instance().Samples();
+}
+
+bool cp_getMinFreeSpace(uint64_t* free_bytes, std::string* mount_point) {
+    return HealthMonitor::Instance().MinFreeSpace(free_bytes, mount_point);
+}
+
+CheckpointRestoreStats cp_getRestoreStats() {
+    std::lock_guard<std::mutex> lock(restoreStatsLock);
+    return restoreStats;
+}
+
 Status cp_markBootAttempt() {
     std::string oldContent, newContent;
     int retry = 0;
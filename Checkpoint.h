@@ -18,7 +18,10 @@
 #define _CHECKPOINT_H
 
 #include <binder/Status.h>
+#include <stdint.h>
+#include <sys/uio.h>
 #include <string>
+#include <vector>
 
 namespace android {
 namespace vold {
@@ -45,6 +48,60 @@ android::binder::Status cp_prepareCheckpoint();
 
 android::binder::Status cp_restoreCheckpoint(const std::string& mountPoint, int count = 0);
 
+// The block device that cp_restoreCheckpoint() works on, which tests replace
+// with one that can lose the writes that were not synced.
+class CheckpointDevice {
+  public:
+    virtual ~CheckpointDevice() {}
+    // These return false unless every byte is transferred.
+    virtual bool Read(void* data, size_t size, uint64_t offset) = 0;
+    virtual bool Write(const struct iovec* iov, int iovcnt, uint64_t offset) = 0;
+    virtual bool Sync() = 0;
+};
+
+android::binder::Status cp_restoreCheckpoint(CheckpointDevice* device, const std::string& name,
+                                             int count = 0);
+
+// What the last call to cp_restoreCheckpoint() did.
+struct CheckpointRestoreStats {
+    std::string device;
+    uint32_t log_sectors = 0;
+    uint64_t log_entries = 0;
+    uint64_t bytes_read = 0;
+    // Restored from data kept from validation, instead of read again.
+    uint64_t bytes_reused = 0;
+    // Includes the markers, unlike bytes_relocated.
+    uint64_t bytes_written = 0;
+    // Data written back to where it was before the checkpoint.
+    uint64_t bytes_relocated = 0;
+    // Partial restore markers written to sector 0.
+    uint32_t markers = 0;
+    uint32_t fsyncs = 0;
+    int64_t validate_ms = 0;
+    int64_t restore_ms = 0;
+};
+
+CheckpointRestoreStats cp_getRestoreStats();
+
+// The last free space sample of a checkpointed filesystem.
+struct CheckpointHealth {
+    std::string mount_point;
+    uint64_t free_bytes = 0;
+    uint64_t min_free_bytes = 0;
+    // How fast free space has been going down, in bytes per second.
+    uint64_t consumption_rate = 0;
+    // When the sample was taken, in milliseconds of CLOCK_BOOTTIME.
+    int64_t time_ms = 0;
+    int64_t poll_interval_ms = 0;
+};
+
+std::vector<CheckpointHealth> cp_getHealth();
+
+// Returns the least free space that the health monitor has seen on any
+// checkpointed filesystem during the current or last checkpoint, and where.
+// Returns false if it hasn't taken any samples.
+bool cp_getMinFreeSpace(uint64_t* free_bytes, std::string* mount_point);
+
 android::binder::Status cp_markBootAttempt();
 
 void cp_resetCheckpoint();
@@ -0,0 +1,48 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ANDROID_VOLD_CRC32_H
+#define ANDROID_VOLD_CRC32_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace android {
+namespace vold {
+
+// Updates |crc| with |n_bytes| of |data|, as dm-bow computes its log checksums:
+// the reflected CRC-32 polynomial 0xEDB88320, with no inversion of the input or
+// output.  Uses the fastest implementation this CPU supports.
+void crc32(const void* data, size_t n_bytes, uint32_t* crc);
+
+typedef void (*Crc32Function)(const void* data, size_t n_bytes, uint32_t* crc);
+
+// The individual implementations, exposed for testing and benchmarking.
+
+// One table lookup per byte.  This is the reference the others must match.
+void crc32_reference(const void* data, size_t n_bytes, uint32_t* crc);
+
+// Eight table lookups per eight bytes.
+void crc32_slice8(const void* data, size_t n_bytes, uint32_t* crc);
+
+// Returns an implementation using the CRC32 instructions of ARMv8 or carry-less
+// multiplication on x86, or nullptr if this CPU has neither.
+Crc32Function crc32_hardware();
+
+}  // namespace vold
+}  // namespace android
+
+#endif
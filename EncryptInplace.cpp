@@ -14,18 +14,40 @@
  * limitations under the License.
  */
 
+#define ATRACE_TAG ATRACE_TAG_PACKAGE_MANAGER
+
 #include "EncryptInplace.h"
 
+#include <endian.h>
 #include <ext4_utils/ext4.h>
 #include <ext4_utils/ext4_utils.h>
 #include <f2fs_sparseblock.h>
 #include <fcntl.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <unistd.h>
 
 #include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string.h>
+#include <thread>
 #include <vector>
 
+#include <android-base/file.h>
 #include <android-base/logging.h>
+#include <android-base/parseint.h>
+#include <android-base/properties.h>
+#include <android-base/stringprintf.h>
+#include <android-base/strings.h>
 #include <android-base/unique_fd.h>
+#include <utils/Trace.h>
 
 enum EncryptInPlaceError {
     kSuccess,
@@ -38,38 +60,318 @@ static uint64_t round_up(uint64_t val, size_t amount) {
     return val;
 }
 
+// The request queue limits of a block device, in bytes.  Zero means unknown.
+struct QueueLimits {
+    uint64_t max_io_size = 0;
+    uint64_t optimal_io_size = 0;
+    uint64_t logical_block_size = 0;
+};
+
+static uint64_t ReadSysfsUint(const std::string& path) {
+    std::string content;
+    uint64_t value;
+    if (!android::base::ReadFileToString(path, &content) ||
+        !android::base::ParseUint(android::base::Trim(content), &value))
+        return 0;
+    return value;
+}
+
+// Reads the queue limits of the block device open at |fd| from sysfs.
+static QueueLimits GetQueueLimits(int fd) {
+    QueueLimits limits;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISBLK(st.st_mode)) return limits;
+
+    std::string dir = android::base::StringPrintf("/sys/dev/block/%u:%u", major(st.st_rdev),
+                                                  minor(st.st_rdev));
+    // Partitions don't have a queue directory of their own; use the disk's.
+    std::string queue = dir + "/queue";
+    if (access(queue.c_str(), F_OK) != 0) queue = dir + "/../queue";
+
+    limits.max_io_size = ReadSysfsUint(queue + "/max_sectors_kb") * 1024;
+    limits.optimal_io_size = ReadSysfsUint(queue + "/optimal_io_size");
+    limits.logical_block_size = ReadSysfsUint(queue + "/logical_block_size");
+    return limits;
+}
+
+// Where the progress of the in-place encryption is published; see
+// InPlaceEncrypter::ReportProgress().
+static const char* kProgressProperty = "vold.encrypt_inplace_progress";
+
+// I/O buffers are aligned to this, which satisfies O_DIRECT on any block device
+// with a logical block size of up to 4096 bytes.
+static const size_t kDirectIOAlignment = 4096;
+
+struct FreeDeleter {
+    void operator()(uint8_t* p) const { free(p); }
+};
+using AlignedBuffer = std::unique_ptr<uint8_t, FreeDeleter>;
+
+// Allocates a buffer of |size| bytes that is usable for O_DIRECT I/O.
+static AlignedBuffer AllocAlignedBuffer(size_t size) {
+    void* p = nullptr;
+    if (posix_memalign(&p, kDirectIOAlignment, size) != 0) {
+        LOG(ERROR) << "Failed to allocate " << size << " byte I/O buffer";
+        return nullptr;
+    }
+    return AlignedBuffer(static_cast<uint8_t*>(p));
+}
+
+// Calls |fn(start, count)| for each run of consecutive set bits among the first
+// |nbits| bits of |bitmap|, which uses the bit order of ext4's bitmap_get_bit().
+// The bitmap is scanned a 64-bit word at a time, so all-zero and all-one words
+// cost a single comparison.  Stops and returns false if |fn| returns false.
+template <typename Fn>
+static bool ForEachSetBitRun(const uint8_t* bitmap, uint32_t nbits, Fn fn) {
+    bool in_run = false;
+    uint32_t run_start = 0;
+
+    for (uint32_t base = 0; base < nbits; base += 64) {
+        uint32_t nbits_in_word = std::min<uint32_t>(64, nbits - base);
+        uint64_t word = 0;
+        memcpy(&word, &bitmap[base / 8], (nbits_in_word + 7) / 8);
+        word = le64toh(word);
+        if (nbits_in_word < 64) word &= (1ULL << nbits_in_word) - 1;
+
+        if (word == (in_run ? ~0ULL : 0)) continue;
+
+        // Alternate between looking for the next set bit (the start of a run)
+        // and the next clear bit (the end of a run) until the word is used up.
+        for (uint32_t pos = 0; pos < 64;) {
+            uint64_t rest = (in_run ? ~word : word) >> pos;
+            if (rest == 0) break;
+            pos += __builtin_ctzll(rest);
+            if (in_run) {
+                if (!fn(run_start, base + pos - run_start)) return false;
+            } else {
+                run_start = base + pos;
+            }
+            in_run = !in_run;
+        }
+    }
+    if (in_run) return fn(run_start, nbits - run_start);
+    return true;
+}
+
+// Writes chunks of data to the crypto device on a separate thread, so that the
+// read of the next chunk from the real device overlaps the write of the
+// previous one.  The caller reads into a buffer from GetBuffer() and then hands
+// it to Submit().  Up to |queue_depth| buffers are in use at once; with a queue
+// depth of 1 there's no writer thread and Submit() writes synchronously.  The
+// buffers are aligned for O_DIRECT.
+//
+// io_uring isn't used here, since it's not available to vold on all devices.
+class ChunkWriter {
+  public:
+    ChunkWriter(int fd, const std::string& path, size_t buffer_size, unsigned int queue_depth);
+    ~ChunkWriter();
+
+    // Returns a free buffer, waiting for an in-flight write to complete if
+    // necessary.  Returns nullptr if any earlier write failed.
+    uint8_t* GetBuffer();
+    // Queues the first |bytes| bytes of |buf| to be written at |offset|.
+    // Returns false if any earlier write failed.
+    bool Submit(uint8_t* buf, size_t bytes, uint64_t offset);
+    // Waits for all queued writes to complete.  Returns false if any failed.
+    bool Flush();
+
+  private:
+    struct Chunk {
+        uint8_t* buf;
+        size_t bytes;
+        uint64_t offset;
+    };
+
+    bool Write(const Chunk& chunk);
+    void WriterLoop();
+
+    int fd_;
+    std::string path_;
+    std::vector<AlignedBuffer> buffers_;
+
+    std::mutex mutex_;
+    std::condition_variable cond_;
+    std::deque<uint8_t*> free_buffers_;
+    std::deque<Chunk> queued_;
+    bool writing_ = false;
+    bool failed_ = false;
+    bool stopping_ = false;
+    std::thread thread_;
+};
+
+ChunkWriter::ChunkWriter(int fd, const std::string& path, size_t buffer_size,
+                         unsigned int queue_depth)
+    : fd_(fd), path_(path) {
+    for (unsigned int i = 0; i < std::max(queue_depth, 1u); i++) {
+        buffers_.push_back(AllocAlignedBuffer(buffer_size));
+        if (!buffers_.back()) {
+            failed_ = true;
+            return;
+        }
+        free_buffers_.push_back(buffers_.back().get());
+    }
+    if (buffers_.size() > 1) thread_ = std::thread(&ChunkWriter::WriterLoop, this);
+}
+
+ChunkWriter::~ChunkWriter() {
+    if (!thread_.joinable()) return;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopping_ = true;
+    }
+    cond_.notify_all();
+    thread_.join();
+}
+
+uint8_t* ChunkWriter::GetBuffer() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    cond_.wait(lock, [this] { return failed_ || !free_buffers_.empty(); });
+    if (failed_) return nullptr;
+    uint8_t* buf = free_buffers_.front();
+    free_buffers_.pop_front();
+    return buf;
+}
+
+bool ChunkWriter::Write(const Chunk& chunk) {
+    if (pwrite64(fd_, chunk.buf, chunk.bytes, chunk.offset) != (ssize_t)chunk.bytes) {
+        PLOG(ERROR) << "Error writing crypto_blkdev " << path_ << " for inplace encrypt";
+        return false;
+    }
+    return true;
+}
+
+bool ChunkWriter::Submit(uint8_t* buf, size_t bytes, uint64_t offset) {
+    Chunk chunk = {buf, bytes, offset};
+    if (!thread_.joinable()) {
+        bool success = Write(chunk);
+        std::lock_guard<std::mutex> lock(mutex_);
+        free_buffers_.push_back(buf);
+        failed_ |= !success;
+        return success;
+    }
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (failed_) return false;
+        queued_.push_back(chunk);
+    }
+    cond_.notify_all();
+    return true;
+}
+
+bool ChunkWriter::Flush() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    cond_.wait(lock, [this] { return failed_ || (queued_.empty() && !writing_); });
+    return !failed_;
+}
+
+void ChunkWriter::WriterLoop() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    for (;;) {
+        cond_.wait(lock, [this] { return stopping_ || !queued_.empty(); });
+        if (queued_.empty()) return;
+        Chunk chunk = queued_.front();
+        queued_.pop_front();
+        writing_ = true;
+
+        lock.unlock();
+        bool success = Write(chunk);
+        lock.lock();
+
+        writing_ = false;
+        free_buffers_.push_back(chunk.buf);
+        if (!success) {
+            // Drop the remaining chunks; the whole operation has failed anyway.
+            failed_ = true;
+            for (const auto& c : queued_) free_buffers_.push_back(c.buf);
+            queued_.clear();
+        }
+        cond_.notify_all();
+    }
+}
+
 class InPlaceEncrypter {
   public:
     bool EncryptInPlace(const std::string& crypto_blkdev, const std::string& real_blkdev,
-                        uint64_t nr_sec);
-    bool ProcessUsedBlock(uint64_t block_num);
+                        uint64_t nr_sec, const EncryptInPlaceOptions& options,
+                        uint64_t* bytes_encrypted);
+    bool ProcessUsedRange(uint64_t start, uint64_t count);
 
   private:
+    // The I/O state of one thread doing the encryption: its own fds, I/O
+    // buffers, and the range of blocks that is waiting to be encrypted.
+    class Worker {
+      public:
+        explicit Worker(InPlaceEncrypter* encrypter) : encrypter_(encrypter) {}
+        bool Open();
+        bool ProcessUsedRange(uint64_t start, uint64_t count);
+        // Encrypts the pending blocks and waits for all writes to complete.
+        bool Finish();
+        uint64_t blocks_done() const { return blocks_done_; }
+
+      private:
+        bool EncryptPendingData();
+
+        InPlaceEncrypter* encrypter_;
+        android::base::unique_fd realfd_;
+        android::base::unique_fd cryptofd_;
+        std::unique_ptr<ChunkWriter> writer_;
+        uint64_t first_pending_block_ = 0;
+        size_t blocks_pending_ = 0;
+        uint64_t blocks_done_ = 0;
+    };
+
     // aligned 32K writes tends to make flash happy.
-    // SD card association recommends it.
+    // SD card association recommends it.  This is the minimum I/O size; it's
+    // raised when the devices' queue limits say that larger I/Os are better.
     static const size_t kIOBufferSize = 32768;
+    // Upper bound on the I/O size chosen from the queue limits.
+    static const size_t kMaxAutoIOBufferSize = 1024 * 1024;
+    // Upper bound on the I/O size set by ro.crypto.inplace_io_size_kb.
+    static constexpr unsigned int kMaxIOSizeKb = 16384;
+
+    // Number of I/O buffers, i.e. the maximum number of chunks in flight at
+    // once.  The default of 4 lets a read overlap a write with a bit of slack
+    // for jitter in device latency.
+    static const unsigned int kDefaultQueueDepth = 4;
+    static constexpr unsigned int kMaxQueueDepth = 64;
+
+    // Number of threads that encrypt ext4 block groups in parallel.  Fast
+    // storage needs several outstanding requests to reach full bandwidth.
+    static const unsigned int kDefaultThreads = 1;
+    static constexpr unsigned int kMaxThreads = 16;
+
+    // How often the progress is published to kProgressProperty and to the
+    // trace counters.  Each update of the property is an IPC to init.
+    static constexpr std::chrono::seconds kReportInterval{2};
 
     // Avoid spamming the logs.  Print the "Encrypting blocks" log message once
     // every 10000 blocks (which is usually every 40 MB or so), and once at the end.
     static const int kLogInterval = 10000;
 
     std::string DescribeFilesystem();
-    void InitFs(const std::string& fs_type, uint64_t blocks_to_encrypt, uint64_t total_blocks,
-                unsigned int block_size);
+    bool InitFs(const std::string& fs_type, uint64_t blocks_to_encrypt, uint64_t total_blocks,
+                unsigned int block_size, unsigned int num_workers = 1);
+    size_t ChooseIOSize(unsigned int block_size);
+    bool CanUseDirectIO(unsigned int block_size);
     void UpdateProgress(size_t blocks, bool done);
-    bool EncryptPendingData();
+    void ReportProgress(std::chrono::steady_clock::time_point now, bool done);
+    bool FinishWorkers();
     bool DoEncryptInPlace();
 
     // ext4 methods
     bool ReadExt4BlockBitmap(uint32_t group, uint8_t* buf);
+    bool ReadExt4BlockBitmaps(std::vector<uint8_t>* bitmaps);
     uint64_t FirstBlockInGroup(uint32_t group);
     uint32_t NumBlocksInGroup(uint32_t group);
     uint32_t NumBaseMetaBlocksInGroup(uint64_t group);
+    bool EncryptExt4Group(Worker* worker, uint32_t group, const uint8_t* block_bitmap);
     EncryptInPlaceError EncryptInPlaceExt4();
 
     // f2fs methods
     EncryptInPlaceError EncryptInPlaceF2fs();
 
+    bool EncryptInPlaceFullDevice();
+
     std::string real_blkdev_;
     std::string crypto_blkdev_;
     uint64_t nr_sec_;
@@ -78,13 +380,30 @@ class InPlaceEncrypter {
     android::base::unique_fd cryptofd_;
 
     std::string fs_type_;
-    uint64_t blocks_done_;
     uint64_t blocks_to_encrypt_;
     unsigned int block_size_;
 
-    std::vector<uint8_t> io_buffer_;
-    uint64_t first_pending_block_;
-    size_t blocks_pending_;
+    unsigned int queue_depth_;
+    unsigned int threads_;
+    unsigned int io_size_kb_;
+    // Whether the workers bypass the page cache.  The encrypter's own fds are
+    // always buffered, since they're only used for small metadata reads.
+    bool direct_io_;
+    QueueLimits real_limits_;
+    QueueLimits crypto_limits_;
+    size_t io_size_;
+    std::vector<std::unique_ptr<Worker>> workers_;
+
+    std::mutex progress_mutex_;
+    uint64_t blocks_done_;
+
+    // Telemetry.  The stall times are the time the workers spent waiting for
+    // reads from the real device and for writes to the crypto device.
+    std::chrono::steady_clock::time_point start_time_;
+    std::chrono::steady_clock::time_point last_report_time_;
+    uint64_t last_report_blocks_;
+    std::atomic<uint64_t> read_stall_ns_;
+    std::atomic<uint64_t> write_stall_ns_;
 };
 
 std::string InPlaceEncrypter::DescribeFilesystem() {
@@ -95,25 +414,91 @@ std::string InPlaceEncrypter::DescribeFilesystem() {
 }
 
 // Finishes initializing the encrypter, now that the filesystem details are known.
-void InPlaceEncrypter::InitFs(const std::string& fs_type, uint64_t blocks_to_encrypt,
-                              uint64_t total_blocks, unsigned int block_size) {
+bool InPlaceEncrypter::InitFs(const std::string& fs_type, uint64_t blocks_to_encrypt,
+                              uint64_t total_blocks, unsigned int block_size,
+                              unsigned int num_workers) {
     fs_type_ = fs_type;
     blocks_done_ = 0;
+    start_time_ = last_report_time_ = std::chrono::steady_clock::now();
+    last_report_blocks_ = 0;
+    read_stall_ns_ = 0;
+    write_stall_ns_ = 0;
     blocks_to_encrypt_ = blocks_to_encrypt;
     block_size_ = block_size;
 
-    // Allocate the I/O buffer.  kIOBufferSize should always be a multiple of
-    // the filesystem block size, but round it up just in case.
-    io_buffer_.resize(round_up(kIOBufferSize, block_size));
-    first_pending_block_ = 0;
-    blocks_pending_ = 0;
+    io_size_ = ChooseIOSize(block_size);
+    if (direct_io_ && !CanUseDirectIO(block_size)) direct_io_ = false;
+    if (direct_io_ && queue_depth_ < 2) {
+        // Without a second buffer, every read would wait for the previous
+        // write, and with O_DIRECT there's no page cache to absorb that.
+        LOG(INFO) << "Raising I/O queue depth to 2 for direct I/O";
+        queue_depth_ = 2;
+    }
 
     LOG(INFO) << "Encrypting " << DescribeFilesystem() << " in-place via " << crypto_blkdev_;
     LOG(INFO) << blocks_to_encrypt << " blocks (" << (blocks_to_encrypt * block_size) / 1000000
               << " MB) of " << total_blocks << " blocks are in-use";
+
+    workers_.clear();
+    for (unsigned int i = 0; i < std::max(num_workers, 1u); i++) {
+        workers_.push_back(std::make_unique<Worker>(this));
+        if (!workers_.back()->Open()) return false;
+    }
+    if (workers_.size() > 1) LOG(INFO) << "Using " << workers_.size() << " encryption threads";
+    return true;
+}
+
+// Chooses the size of each read and write.  Unless overridden by
+// ro.crypto.inplace_io_size_kb, this is the largest I/O that both devices
+// accept in one request (up to kMaxAutoIOBufferSize), but at least their
+// optimal I/O size and kIOBufferSize.  I/Os are aligned to this size.
+size_t InPlaceEncrypter::ChooseIOSize(unsigned int block_size) {
+    uint64_t io_size;
+    if (io_size_kb_ != 0) {
+        io_size = io_size_kb_ * 1024ULL;
+    } else {
+        uint64_t max_io_size = kMaxAutoIOBufferSize;
+        if (real_limits_.max_io_size != 0)
+            max_io_size = std::min(max_io_size, real_limits_.max_io_size);
+        if (crypto_limits_.max_io_size != 0)
+            max_io_size = std::min(max_io_size, crypto_limits_.max_io_size);
+        io_size = std::max({max_io_size, real_limits_.optimal_io_size,
+                            crypto_limits_.optimal_io_size, (uint64_t)kIOBufferSize});
+    }
+    // The I/O size must be a multiple of the filesystem block size and of the
+    // devices' logical block sizes.  These are powers of 2, so rounding up to
+    // the largest of them is enough.
+    uint64_t alignment = std::max({(uint64_t)block_size, real_limits_.logical_block_size,
+                                   crypto_limits_.logical_block_size});
+    io_size = round_up(io_size, alignment);
+
+    LOG(INFO) << "Using " << io_size / 1024 << " KiB I/Os (max_sectors_kb "
+              << real_limits_.max_io_size / 1024 << "/" << crypto_limits_.max_io_size / 1024
+              << ", optimal_io_size " << real_limits_.optimal_io_size << "/"
+              << crypto_limits_.optimal_io_size << ")";
+    return io_size;
+}
+
+// Direct I/O requires each I/O's offset and size to be a multiple of the
+// devices' logical block size.  All I/Os are made of whole filesystem blocks, so
+// that holds if the filesystem block size is a multiple of the logical block
+// size.  It doesn't when the full-device fallback has to use 512-byte units.
+bool InPlaceEncrypter::CanUseDirectIO(unsigned int block_size) {
+    uint64_t alignment = std::max(real_limits_.logical_block_size,
+                                  crypto_limits_.logical_block_size);
+    if (alignment == 0) alignment = kDirectIOAlignment;
+    if (alignment > kDirectIOAlignment || block_size % alignment != 0) {
+        LOG(INFO) << "Not using direct I/O: block size " << block_size
+                  << " isn't aligned to logical block size " << alignment;
+        return false;
+    }
+    LOG(INFO) << "Using direct I/O";
+    return true;
 }
 
 void InPlaceEncrypter::UpdateProgress(size_t blocks, bool done) {
+    std::lock_guard<std::mutex> lock(progress_mutex_);
+
     // A log message already got printed for blocks_done_ if one was due, so the
     // next message will be due at the *next* block rounded up to kLogInterval.
     uint64_t blocks_next_msg = round_up(blocks_done_ + 1, kLogInterval);
@@ -128,45 +513,178 @@ void InPlaceEncrypter::UpdateProgress(size_t blocks, bool done) {
 
     if (blocks_done_ >= blocks_next_msg)
         LOG(DEBUG) << "Encrypted " << blocks_next_msg << " of " << blocks_to_encrypt_ << " blocks";
+
+    auto now = std::chrono::steady_clock::now();
+    if (done || now - last_report_time_ >= kReportInterval) ReportProgress(now, done);
 }
 
-bool InPlaceEncrypter::EncryptPendingData() {
-    if (blocks_pending_ == 0) return true;
+// Publishes the progress to kProgressProperty and to trace counters, so that a
+// slow encryption can be told apart as slow reads, slow writes, or neither.
+// The property holds space-separated decimal fields:
+//
+//     <bytes done> <bytes total> <instantaneous KiB/s> <average KiB/s>
+//     <read stall ms> <write stall ms> <ETA s>
+//
+// The instantaneous rate is over the time since the previous report.  Must be
+// called with progress_mutex_ held.
+void InPlaceEncrypter::ReportProgress(std::chrono::steady_clock::time_point now, bool done) {
+    using std::chrono::duration_cast;
+    using std::chrono::milliseconds;
+
+    uint64_t bytes_done = blocks_done_ * block_size_;
+    // blocks_to_encrypt_ is only an estimate.
+    uint64_t bytes_total =
+            (done ? blocks_done_ : std::max(blocks_to_encrypt_, blocks_done_)) * block_size_;
+    uint64_t elapsed_ms = duration_cast<milliseconds>(now - start_time_).count();
+    uint64_t interval_ms = duration_cast<milliseconds>(now - last_report_time_).count();
+    uint64_t avg_kbps = elapsed_ms ? bytes_done * 1000 / 1024 / elapsed_ms : 0;
+    uint64_t inst_kbps =
+            interval_ms ? (blocks_done_ - last_report_blocks_) * block_size_ * 1000 / 1024 /
+                                  interval_ms
+                        : 0;
+    uint64_t eta_s = avg_kbps ? (bytes_total - bytes_done) / 1024 / avg_kbps : 0;
+    uint64_t read_stall_ms = read_stall_ns_ / 1000000;
+    uint64_t write_stall_ms = write_stall_ns_ / 1000000;
+    last_report_time_ = now;
+    last_report_blocks_ = blocks_done_;
+
+    android::base::SetProperty(
+            kProgressProperty,
+            android::base::StringPrintf("%" PRIu64 " %" PRIu64 " %" PRIu64 " %" PRIu64 " %" PRIu64
+                                        " %" PRIu64 " %" PRIu64,
+                                        bytes_done, bytes_total, inst_kbps, avg_kbps,
+                                        read_stall_ms, write_stall_ms, eta_s));
+    ATRACE_INT64("encrypt_inplace_bytes_done", bytes_done);
+    ATRACE_INT64("encrypt_inplace_kbps", inst_kbps);
+    ATRACE_INT64("encrypt_inplace_read_stall_ms", read_stall_ms);
+    ATRACE_INT64("encrypt_inplace_write_stall_ms", write_stall_ms);
+    ATRACE_INT64("encrypt_inplace_eta_s", eta_s);
+
+    if (done) {
+        LOG(INFO) << "Encrypted " << bytes_done / 1048576 << " MiB in " << elapsed_ms / 1000
+                  << " s (" << avg_kbps / 1024 << " MiB/s); stalled " << read_stall_ms
+                  << " ms on reads and " << write_stall_ms << " ms on writes";
+    }
+}
 
-    ssize_t bytes = blocks_pending_ * block_size_;
-    uint64_t offset = first_pending_block_ * block_size_;
+// Finishes the work of all workers, and checks that their progress counters
+// add up to the total.
+bool InPlaceEncrypter::FinishWorkers() {
+    bool success = true;
+    uint64_t blocks_done = 0;
+    for (auto& worker : workers_) {
+        success &= worker->Finish();
+        blocks_done += worker->blocks_done();
+    }
+    if (success && blocks_done != blocks_done_) {
+        LOG(ERROR) << "Workers encrypted " << blocks_done << " blocks but " << blocks_done_
+                   << " blocks were reported";
+        return false;
+    }
+    return success;
+}
 
-    if (pread64(realfd_, &io_buffer_[0], bytes, offset) != bytes) {
-        PLOG(ERROR) << "Error reading real_blkdev " << real_blkdev_ << " for inplace encrypt";
+bool InPlaceEncrypter::Worker::Open() {
+    int direct = encrypter_->direct_io_ ? O_DIRECT : 0;
+    realfd_.reset(open64(encrypter_->real_blkdev_.c_str(), O_RDONLY | O_CLOEXEC | direct));
+    if (realfd_ < 0 && direct && errno == EINVAL) {
+        PLOG(WARNING) << "Direct I/O isn't supported by " << encrypter_->real_blkdev_
+                      << "; falling back to buffered I/O";
+        direct = 0;
+        realfd_.reset(open64(encrypter_->real_blkdev_.c_str(), O_RDONLY | O_CLOEXEC));
+    }
+    if (realfd_ < 0) {
+        PLOG(ERROR) << "Error opening real_blkdev " << encrypter_->real_blkdev_
+                    << " for inplace encrypt";
+        return false;
+    }
+    cryptofd_.reset(open64(encrypter_->crypto_blkdev_.c_str(), O_WRONLY | O_CLOEXEC | direct));
+    if (cryptofd_ < 0 && direct && errno == EINVAL) {
+        PLOG(WARNING) << "Direct I/O isn't supported by " << encrypter_->crypto_blkdev_
+                      << "; falling back to buffered I/O";
+        cryptofd_.reset(open64(encrypter_->crypto_blkdev_.c_str(), O_WRONLY | O_CLOEXEC));
+    }
+    if (cryptofd_ < 0) {
+        PLOG(ERROR) << "Error opening crypto_blkdev " << encrypter_->crypto_blkdev_
+                    << " for inplace encrypt";
         return false;
     }
+    writer_ = std::make_unique<ChunkWriter>(cryptofd_, encrypter_->crypto_blkdev_,
+                                            encrypter_->io_size_, encrypter_->queue_depth_);
+    return true;
+}
+
+bool InPlaceEncrypter::Worker::EncryptPendingData() {
+    if (blocks_pending_ == 0) return true;
+
+    ssize_t bytes = blocks_pending_ * encrypter_->block_size_;
+    uint64_t offset = first_pending_block_ * encrypter_->block_size_;
 
-    if (pwrite64(cryptofd_, &io_buffer_[0], bytes, offset) != bytes) {
-        PLOG(ERROR) << "Error writing crypto_blkdev " << crypto_blkdev_ << " for inplace encrypt";
+    // Waiting for a free buffer means waiting for a write to complete, as does
+    // Submit() when writes are synchronous.
+    auto start = std::chrono::steady_clock::now();
+    uint8_t* buf = writer_->GetBuffer();
+    if (buf == nullptr) return false;
+    auto read_start = std::chrono::steady_clock::now();
+
+    if (pread64(realfd_, buf, bytes, offset) != bytes) {
+        PLOG(ERROR) << "Error reading real_blkdev " << encrypter_->real_blkdev_
+                    << " for inplace encrypt";
         return false;
     }
+    auto read_end = std::chrono::steady_clock::now();
+
+    if (!writer_->Submit(buf, bytes, offset)) return false;
+    auto end = std::chrono::steady_clock::now();
+
+    encrypter_->read_stall_ns_ += std::chrono::nanoseconds(read_end - read_start).count();
+    encrypter_->write_stall_ns_ +=
+            std::chrono::nanoseconds((read_start - start) + (end - read_end)).count();
 
-    UpdateProgress(blocks_pending_, false);
+    blocks_done_ += blocks_pending_;
+    encrypter_->UpdateProgress(blocks_pending_, false);
 
     blocks_pending_ = 0;
     return true;
 }
 
-bool InPlaceEncrypter::ProcessUsedBlock(uint64_t block_num) {
-    // Flush if the amount of pending data has reached the I/O buffer size, if
-    // there's a gap between the pending blocks and the next block (due to
-    // block(s) not being used by the filesystem and thus not needing
-    // encryption), or if the next block will be aligned to the I/O buffer size.
-    if (blocks_pending_ * block_size_ == io_buffer_.size() ||
-        block_num != first_pending_block_ + blocks_pending_ ||
-        (block_num * block_size_) % io_buffer_.size() == 0) {
-        if (!EncryptPendingData()) return false;
-        first_pending_block_ = block_num;
+// Adds the |count| used blocks starting at |start| to the pending data.
+bool InPlaceEncrypter::Worker::ProcessUsedRange(uint64_t start, uint64_t count) {
+    uint64_t block_size = encrypter_->block_size_;
+    uint64_t blocks_per_io = encrypter_->io_size_ / block_size;
+
+    while (count > 0) {
+        // Flush if the amount of pending data has reached the I/O buffer size,
+        // if there's a gap between the pending blocks and the next block (due
+        // to block(s) not being used by the filesystem and thus not needing
+        // encryption), or if the next block will be aligned to the I/O buffer
+        // size.
+        uint64_t blocks_to_boundary = blocks_per_io - (start % blocks_per_io);
+        if (blocks_pending_ == blocks_per_io || start != first_pending_block_ + blocks_pending_ ||
+            blocks_to_boundary == blocks_per_io) {
+            if (!EncryptPendingData()) return false;
+            first_pending_block_ = start;
+        }
+        uint64_t n = std::min({count, blocks_to_boundary, blocks_per_io - blocks_pending_});
+        blocks_pending_ += n;
+        start += n;
+        count -= n;
     }
-    blocks_pending_++;
     return true;
 }
 
+bool InPlaceEncrypter::Worker::Finish() {
+    if (!writer_) return false;
+    bool success = EncryptPendingData();
+    // Wait for the writes that are still in flight even if that failed.
+    success &= writer_->Flush();
+    return success;
+}
+
+bool InPlaceEncrypter::ProcessUsedRange(uint64_t start, uint64_t count) {
+    return workers_[0]->ProcessUsedRange(start, count);
+}
+
 // Reads the block bitmap for block group |group| into |buf|.
 bool InPlaceEncrypter::ReadExt4BlockBitmap(uint32_t group, uint8_t* buf) {
     uint64_t offset = (uint64_t)aux_info.bg_desc[group].bg_block_bitmap * info.block_size;
@@ -177,6 +695,22 @@ bool InPlaceEncrypter::ReadExt4BlockBitmap(uint32_t group, uint8_t* buf) {
     return true;
 }
 
+// Reads the block bitmaps of all initialized block groups into |bitmaps|, one
+// filesystem block per group.  This must happen before anything is encrypted:
+// with flex_bg the bitmaps of later groups are stored in an earlier group, so
+// by the time a later group is reached its bitmap may already be ciphertext on
+// disk.  Buffered reads of the real device would usually still hit the
+// plaintext in the page cache, but direct I/O doesn't populate it.
+bool InPlaceEncrypter::ReadExt4BlockBitmaps(std::vector<uint8_t>* bitmaps) {
+    bitmaps->resize((uint64_t)aux_info.groups * info.block_size);
+    for (uint32_t group = 0; group < aux_info.groups; group++) {
+        if (aux_info.bg_desc[group].bg_flags & EXT4_BG_BLOCK_UNINIT) continue;
+        if (!ReadExt4BlockBitmap(group, &(*bitmaps)[(uint64_t)group * info.block_size]))
+            return false;
+    }
+    return true;
+}
+
 uint64_t InPlaceEncrypter::FirstBlockInGroup(uint32_t group) {
     return aux_info.first_data_block + (group * (uint64_t)info.blocks_per_group);
 }
@@ -193,6 +727,21 @@ uint32_t InPlaceEncrypter::NumBaseMetaBlocksInGroup(uint64_t group) {
     return 1 + aux_info.bg_desc_blocks;
 }
 
+// Encrypts each used block in block group |group|.  |block_bitmap| is the
+// group's block bitmap, as read by ReadExt4BlockBitmaps().
+bool InPlaceEncrypter::EncryptExt4Group(Worker* worker, uint32_t group,
+                                        const uint8_t* block_bitmap) {
+    uint64_t first_block_num = FirstBlockInGroup(group);
+
+    if (aux_info.bg_desc[group].bg_flags & EXT4_BG_BLOCK_UNINIT)
+        return worker->ProcessUsedRange(first_block_num, NumBaseMetaBlocksInGroup(group));
+
+    return ForEachSetBitRun(block_bitmap, NumBlocksInGroup(group),
+                            [worker, first_block_num](uint32_t start, uint32_t count) {
+                                return worker->ProcessUsedRange(first_block_num + start, count);
+                            });
+}
+
 EncryptInPlaceError InPlaceEncrypter::EncryptInPlaceExt4() {
     if (setjmp(setjmp_env))  // NOLINT
         return kFilesystemNotFound;
@@ -210,29 +759,66 @@ EncryptInPlaceError InPlaceEncrypter::EncryptInPlaceExt4() {
                     (NumBlocksInGroup(group) - aux_info.bg_desc[group].bg_free_blocks_count);
     }
 
-    InitFs("ext4", blocks_to_encrypt, aux_info.len_blocks, info.block_size);
+    std::vector<uint8_t> block_bitmaps;
+    if (!ReadExt4BlockBitmaps(&block_bitmaps)) return kFailed;
+    auto group_bitmap = [&](uint32_t group) {
+        return &block_bitmaps[(uint64_t)group * info.block_size];
+    };
 
-    // Encrypt each block group.
-    std::vector<uint8_t> block_bitmap(info.block_size);
-    for (uint32_t group = 0; group < aux_info.groups; group++) {
-        if (!ReadExt4BlockBitmap(group, &block_bitmap[0])) return kFailed;
+    unsigned int num_workers = std::min<uint64_t>(threads_, aux_info.groups);
+    if (!InitFs("ext4", blocks_to_encrypt, aux_info.len_blocks, info.block_size, num_workers))
+        return kFailed;
 
-        uint64_t first_block_num = FirstBlockInGroup(group);
-        bool uninit = (aux_info.bg_desc[group].bg_flags & EXT4_BG_BLOCK_UNINIT);
-        uint32_t block_count = uninit ? NumBaseMetaBlocksInGroup(group) : NumBlocksInGroup(group);
-
-        // Encrypt each used block in the block group.
-        for (uint32_t i = 0; i < block_count; i++) {
-            if (uninit || bitmap_get_bit(&block_bitmap[0], i))
-                ProcessUsedBlock(first_block_num + i);
+    if (workers_.size() == 1) {
+        for (uint32_t group = 0; group < aux_info.groups; group++) {
+            if (!EncryptExt4Group(workers_[0].get(), group, group_bitmap(group))) return kFailed;
         }
+        return kSuccess;
     }
-    return kSuccess;
+
+    // Hand out the block groups to the workers in increasing order.  Each
+    // worker takes the next unclaimed group whenever it finishes one.
+    std::atomic<uint32_t> next_group(0);
+    std::atomic<bool> failed(false);
+    std::vector<std::thread> threads;
+    for (auto& worker : workers_) {
+        threads.emplace_back([this, &next_group, &failed, &group_bitmap, worker = worker.get()] {
+            while (!failed) {
+                uint32_t group = next_group++;
+                if (group >= aux_info.groups) break;
+                if (!EncryptExt4Group(worker, group, group_bitmap(group))) failed = true;
+            }
+        });
+    }
+    for (auto& thread : threads) thread.join();
+    return failed ? kFailed : kSuccess;
 }
 
-static int encrypt_f2fs_block(uint64_t block_num, void* _encrypter) {
-    InPlaceEncrypter* encrypter = reinterpret_cast<InPlaceEncrypter*>(_encrypter);
-    if (!encrypter->ProcessUsedBlock(block_num)) return -1;
+// run_on_used_blocks() reports the used blocks of an f2fs filesystem one at a
+// time.  Merge consecutive blocks into extents before passing them on, so that
+// the I/O layer sees ranges rather than individual blocks.
+struct F2fsExtentCoalescer {
+    InPlaceEncrypter* encrypter;
+    uint64_t start = 0;
+    uint64_t count = 0;
+
+    bool Flush() {
+        if (count == 0) return true;
+        bool success = encrypter->ProcessUsedRange(start, count);
+        count = 0;
+        return success;
+    }
+};
+
+static int encrypt_f2fs_block(uint64_t block_num, void* _coalescer) {
+    F2fsExtentCoalescer* coalescer = reinterpret_cast<F2fsExtentCoalescer*>(_coalescer);
+    if (coalescer->count != 0 && block_num == coalescer->start + coalescer->count) {
+        coalescer->count++;
+        return 0;
+    }
+    if (!coalescer->Flush()) return -1;
+    coalescer->start = block_num;
+    coalescer->count = 1;
     return 0;
 }
 
@@ -241,11 +827,44 @@ EncryptInPlaceError InPlaceEncrypter::EncryptInPlaceF2fs() {
             generate_f2fs_info(realfd_), free_f2fs_info);
     if (!fs_info) return kFilesystemNotFound;
 
-    InitFs("f2fs", get_num_blocks_used(fs_info.get()), fs_info->total_blocks, fs_info->block_size);
-    if (run_on_used_blocks(0, fs_info.get(), encrypt_f2fs_block, this) != 0) return kFailed;
+    if (!InitFs("f2fs", get_num_blocks_used(fs_info.get()), fs_info->total_blocks,
+                fs_info->block_size))
+        return kFailed;
+    F2fsExtentCoalescer coalescer = {.encrypter = this};
+    if (run_on_used_blocks(0, fs_info.get(), encrypt_f2fs_block, &coalescer) != 0) return kFailed;
+    if (!coalescer.Flush()) return kFailed;
     return kSuccess;
 }
 
+// Encrypts all of the block device.  The device is treated as a sequence of
+// 4096-byte blocks if its size allows it, so that direct I/O can be used, and
+// as 512-byte sectors otherwise.  Either way, it's streamed in whole I/Os with
+// each worker thread taking one contiguous stripe.
+bool InPlaceEncrypter::EncryptInPlaceFullDevice() {
+    unsigned int sectors_per_block = (nr_sec_ % 8 == 0) ? 8 : 1;
+    uint64_t num_blocks = nr_sec_ / sectors_per_block;
+
+    if (!InitFs("", num_blocks, num_blocks, 512 * sectors_per_block, threads_)) return false;
+
+    if (workers_.size() == 1) return ProcessUsedRange(0, num_blocks);
+
+    // Make the stripes a whole number of I/Os, so that no I/O gets split
+    // between two workers.
+    uint64_t blocks_per_io = io_size_ / block_size_;
+    uint64_t stripe = round_up((num_blocks + workers_.size() - 1) / workers_.size(), blocks_per_io);
+    std::atomic<bool> failed(false);
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < workers_.size(); i++) {
+        uint64_t start = std::min(i * stripe, num_blocks);
+        uint64_t count = std::min(stripe, num_blocks - start);
+        threads.emplace_back([&failed, worker = workers_[i].get(), start, count] {
+            if (!worker->ProcessUsedRange(start, count)) failed = true;
+        });
+    }
+    for (auto& thread : threads) thread.join();
+    return !failed;
+}
+
 bool InPlaceEncrypter::DoEncryptInPlace() {
     EncryptInPlaceError rc;
 
@@ -257,18 +876,28 @@ bool InPlaceEncrypter::DoEncryptInPlace() {
 
     LOG(WARNING) << "No recognized filesystem found on " << real_blkdev_
                  << ".  Falling back to encrypting the full block device.";
-    InitFs("", nr_sec_, nr_sec_, 512);
-    for (uint64_t i = 0; i < nr_sec_; i++) {
-        if (!ProcessUsedBlock(i)) return false;
-    }
-    return true;
+    return EncryptInPlaceFullDevice();
 }
 
 bool InPlaceEncrypter::EncryptInPlace(const std::string& crypto_blkdev,
-                                      const std::string& real_blkdev, uint64_t nr_sec) {
+                                      const std::string& real_blkdev, uint64_t nr_sec,
+                                      const EncryptInPlaceOptions& options,
+                                      uint64_t* bytes_encrypted) {
     real_blkdev_ = real_blkdev;
     crypto_blkdev_ = crypto_blkdev;
     nr_sec_ = nr_sec;
+    queue_depth_ = options.queue_depth ? std::min(*options.queue_depth, kMaxQueueDepth)
+                                       : android::base::GetUintProperty(
+                                                 "ro.crypto.inplace_queue_depth",
+                                                 kDefaultQueueDepth, kMaxQueueDepth);
+    threads_ = options.threads ? std::min(*options.threads, kMaxThreads)
+                               : android::base::GetUintProperty("ro.crypto.inplace_threads",
+                                                                kDefaultThreads, kMaxThreads);
+    io_size_kb_ = options.io_size_kb ? std::min(*options.io_size_kb, kMaxIOSizeKb)
+                                     : android::base::GetUintProperty(
+                                               "ro.crypto.inplace_io_size_kb", 0u, kMaxIOSizeKb);
+    direct_io_ = options.direct_io.value_or(
+            android::base::GetBoolProperty("ro.crypto.inplace_direct_io", false));
 
     realfd_.reset(open64(real_blkdev.c_str(), O_RDONLY | O_CLOEXEC));
     if (realfd_ < 0) {
@@ -282,9 +911,14 @@ bool InPlaceEncrypter::EncryptInPlace(const std::string& crypto_blkdev,
         return false;
     }
 
+    real_limits_ = GetQueueLimits(realfd_);
+    crypto_limits_ = GetQueueLimits(cryptofd_);
+
     bool success = DoEncryptInPlace();
 
-    if (success) success &= EncryptPendingData();
+    // Encrypt the remaining pending blocks and wait for the writes that are
+    // still in flight.  This is needed even on failure, to stop the workers.
+    if (!workers_.empty()) success &= FinishWorkers();
 
     if (success && fsync(cryptofd_) != 0) {
         PLOG(ERROR) << "Error syncing " << crypto_blkdev_;
@@ -305,6 +939,7 @@ bool InPlaceEncrypter::EncryptInPlace(const std::string& crypto_blkdev,
     // "Encrypted 50000 of 50327 blocks".
     UpdateProgress(0, true);
 
+    if (bytes_encrypted) *bytes_encrypted = blocks_done_ * block_size_;
     LOG(INFO) << "Successfully encrypted " << DescribeFilesystem();
     return true;
 }
@@ -314,11 +949,15 @@ bool InPlaceEncrypter::EncryptInPlace(const std::string& crypto_blkdev,
 // device backed by |real_blkdev|.  The size to encrypt is |nr_sec| 512-byte
 // sectors; however, if a filesystem is detected, then its size will be used
 // instead, and only the in-use blocks of the filesystem will be encrypted.
+//
+// |options| overrides the tuning properties, and |bytes_encrypted| is set to
+// the number of bytes encrypted on success; both are meant for benchmarking.
 bool encrypt_inplace(const std::string& crypto_blkdev, const std::string& real_blkdev,
-                     uint64_t nr_sec) {
+                     uint64_t nr_sec, const EncryptInPlaceOptions& options,
+                     uint64_t* bytes_encrypted) {
     LOG(DEBUG) << "encrypt_inplace(" << crypto_blkdev << ", " << real_blkdev << ", " << nr_sec
                << ")";
 
     InPlaceEncrypter encrypter;
-    return encrypter.EncryptInPlace(crypto_blkdev, real_blkdev, nr_sec);
+    return encrypter.EncryptInPlace(crypto_blkdev, real_blkdev, nr_sec, options, bytes_encrypted);
 }
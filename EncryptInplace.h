@@ -18,9 +18,20 @@
 #define _ENCRYPT_INPLACE_H
 
 #include <stdint.h>
+#include <optional>
 #include <string>
 
+// Overrides for the ro.crypto.inplace_* properties that tune the in-place
+// encryption.  Fields that aren't set are taken from the properties.
+struct EncryptInPlaceOptions {
+    std::optional<unsigned int> queue_depth;
+    std::optional<unsigned int> threads;
+    std::optional<unsigned int> io_size_kb;
+    std::optional<bool> direct_io;
+};
+
 bool encrypt_inplace(const std::string& crypto_blkdev, const std::string& real_blkdev,
-                     uint64_t nr_sec);
+                     uint64_t nr_sec, const EncryptInPlaceOptions& options = {},
+                     uint64_t* bytes_encrypted = nullptr);
 
 #endif
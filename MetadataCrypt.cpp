@@ -245,6 +245,11 @@ static bool parse_options(const std::string& options_string, CryptoOptions* opti
     return true;
 }
 
+// Marks a partition whose metadata encryption is in progress.  If vold stops
+// before Remove(), the marker is still there on the next boot, and fs_mgr then
+// formats the partition rather than asking vold to encrypt it again.  So an
+// interrupted in-place encryption is never resumed, and encrypt_inplace() has
+// no need to record how far it got.
 class EncryptionInProgress {
   private:
     std::string file_path_;
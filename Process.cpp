@@ -25,18 +25,31 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/pidfd.h>
 #include <sys/stat.h>
+#include <sys/sysmacros.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <atomic>
 #include <fstream>
 #include <mntent.h>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
 #include <unordered_set>
+#include <vector>
 
 #include <android-base/file.h>
 #include <android-base/logging.h>
 #include <android-base/parseint.h>
+#include <android-base/properties.h>
 #include <android-base/stringprintf.h>
 #include <android-base/strings.h>
+#include <android-base/unique_fd.h>
 
 #include "Process.h"
 #include "Utils.h"
@@ -46,133 +59,382 @@ using android::base::StringPrintf;
 namespace android {
 namespace vold {
 
-static bool checkMaps(const std::string& path, const std::string& prefix) {
-    bool found = false;
-    auto file = std::unique_ptr<FILE, decltype(&fclose)>{fopen(path.c_str(), "re"), fclose};
-    if (!file) {
+// Big enough for hundreds of maps lines per read(), and for the longest line.
+static constexpr size_t kMapsBufferSize = 64 * 1024;
+
+// Checks the path of one maps line, found in place from its first '/'.
+static bool checkMapsLine(pid_t pid, const char* begin, const char* end,
+                          const std::string& prefix) {
+    auto path = static_cast<const char*>(memchr(begin, '/', end - begin));
+    if (path == nullptr || static_cast<size_t>(end - path) < prefix.size()) return false;
+    if (memcmp(path, prefix.data(), prefix.size()) != 0) return false;
+    LOG(WARNING) << "Found map /proc/" << pid << "/maps referencing "
+                 << std::string_view(path, end - path);
+    return true;
+}
+
+// Calls |fn| with the bounds of each line of /proc/<pid>/maps, without its
+// newline, until it returns true.  Returns whether it did.
+template <typename Fn>
+static bool findMapsLine(int dir_fd, Fn fn) {
+    android::base::unique_fd fd(openat(dir_fd, "maps", O_RDONLY | O_CLOEXEC));
+    if (fd == -1) {
         return false;
     }
 
-    char* buf = nullptr;
+    // One allocation per process rather than per line.  It's freed on return,
+    // so idle binder and scan threads don't keep it.
+    std::unique_ptr<char[]> buf(new char[kMapsBufferSize]);
+
     size_t len = 0;
-    while (getline(&buf, &len, file.get()) != -1) {
-        std::string line(buf);
-        std::string::size_type pos = line.find('/');
-        if (pos != std::string::npos) {
-            line = line.substr(pos);
-            if (android::base::StartsWith(line, prefix)) {
-                LOG(WARNING) << "Found map " << path << " referencing " << line;
-                found = true;
+    // Whether we are dropping the rest of a line that didn't fit in buf
+    bool skipping = false;
+    while (true) {
+        ssize_t n = TEMP_FAILURE_RETRY(read(fd, buf.get() + len, kMapsBufferSize - len));
+        if (n < 0) {
+            return false;
+        }
+        bool eof = n == 0;
+        len += n;
+
+        char* pos = buf.get();
+        char* end = pos + len;
+        while (pos < end) {
+            auto eol = static_cast<char*>(memchr(pos, '\n', end - pos));
+            if (eol == nullptr) {
+                // Read the rest of a partial line, unless it fills buf already
+                if (!eof && (pos != buf.get() || len < kMapsBufferSize)) break;
+                if (!skipping && fn(pos, end)) return true;
+                skipping = !eof;
+                pos = end;
                 break;
             }
+            if (!skipping && fn(pos, eol)) return true;
+            skipping = false;
+            pos = eol + 1;
+        }
+        if (eof) {
+            return false;
         }
+        len = end - pos;
+        memmove(buf.get(), pos, len);
+    }
+}
+
+static bool checkMaps(pid_t pid, int dir_fd, const std::string& prefix) {
+    return findMapsLine(dir_fd, [&](const char* begin, const char* end) {
+        return checkMapsLine(pid, begin, end, prefix);
+    });
+}
+
+static bool parseHex(const char** pos, const char* end, unsigned int* value) {
+    const char* begin = *pos;
+    *value = 0;
+    for (; *pos < end && isxdigit(**pos); ++*pos) {
+        *value = *value * 16 + (isdigit(**pos) ? **pos - '0' : tolower(**pos) - 'a' + 10);
+    }
+    return *pos != begin;
+}
+
+// Parses the device of a maps line: "address perms offset major:minor inode path".
+static bool parseMapsDevice(const char* begin, const char* end, dev_t* dev) {
+    const char* pos = begin;
+    for (int field = 0; field < 3; field++) {
+        pos = static_cast<const char*>(memchr(pos, ' ', end - pos));
+        if (pos == nullptr) return false;
+        pos++;
+    }
+    unsigned int major, minor;
+    if (!parseHex(&pos, end, &major) || pos == end || *pos++ != ':' ||
+        !parseHex(&pos, end, &minor)) {
+        return false;
+    }
+    *dev = makedev(major, minor);
+    return true;
+}
+
+// Gets the device of the file that |name| links to.  AT_STATX_DONT_SYNC keeps
+// this from waiting on a FUSE daemon, which may be one of the processes that
+// are about to be killed.
+static bool statDevice(int dir_fd, const char* name, dev_t* dev) {
+    struct statx stx;
+    if (statx(dir_fd, name, AT_STATX_DONT_SYNC, 0, &stx) != 0) return false;
+    *dev = makedev(stx.stx_dev_major, stx.stx_dev_minor);
+    return true;
+}
+
+// Calls |fn| with the name of each link in /proc/<pid>/fd, relative to
+// /proc/<pid>, until it returns true.  Returns whether it did.
+template <typename Fn>
+static bool findFd(pid_t pid, int dir_fd, Fn fn) {
+    android::base::unique_fd fd(openat(dir_fd, "fd", O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+    auto fd_d = std::unique_ptr<DIR, int (*)(DIR*)>(
+            fd == -1 ? nullptr : fdopendir(fd.get()), closedir);
+    if (!fd_d) {
+        PLOG(WARNING) << "Failed to open /proc/" << pid << "/fd";
+        return false;
     }
-    free(buf);
+    fd.release();
+    struct dirent* fd_de;
+    while ((fd_de = readdir(fd_d.get())) != nullptr) {
+        if (fd_de->d_type != DT_LNK) continue;
+        std::string name = std::string("fd/") + fd_de->d_name;
+        if (fn(name.c_str())) return true;
+    }
+    return false;
+}
 
-    return found;
+static bool checkTarget(pid_t pid, const char* name, const std::string& target,
+                        const std::string& prefix) {
+    if (android::base::StartsWith(target, prefix)) {
+        LOG(WARNING) << "Found symlink /proc/" << pid << "/" << name << " referencing " << target;
+        return true;
+    }
+    return false;
 }
 
-static bool checkSymlink(const std::string& path, const std::string& prefix) {
+static bool checkSymlink(pid_t pid, int dir_fd, const char* name, const std::string& prefix) {
     std::string res;
-    if (android::base::Readlink(path, &res)) {
-        if (android::base::StartsWith(res, prefix)) {
-            LOG(WARNING) << "Found symlink " << path << " referencing " << res;
+    return Readlinkat(dir_fd, name, &res) && checkTarget(pid, name, res, prefix);
+}
+
+const std::string& ProcessInfo::link(const char* name, std::optional<std::string>* cache) {
+    if (!*cache) {
+        cache->emplace();
+        if (!Readlinkat(dir_fd_, name, &**cache)) (*cache)->clear();
+    }
+    return **cache;
+}
+
+const std::string& ProcessInfo::exe() {
+    return link("exe", &exe_);
+}
+
+const std::string& ProcessInfo::cwd() {
+    return link("cwd", &cwd_);
+}
+
+const std::string& ProcessInfo::root() {
+    return link("root", &root_);
+}
+
+bool ProcessInfo::hasOpenFilesUnder(const std::string& prefix) {
+    if (checkMaps(pid_, dir_fd_, prefix)) return true;
+    if (checkTarget(pid_, "cwd", cwd(), prefix) || checkTarget(pid_, "root", root(), prefix) ||
+        checkTarget(pid_, "exe", exe(), prefix)) {
+        return true;
+    }
+
+    return findFd(pid_, dir_fd_, [&](const char* name) {
+        return checkSymlink(pid_, dir_fd_, name, prefix);
+    });
+}
+
+bool ProcessInfo::findFileDevice(const std::function<bool(dev_t)>& fn) {
+    // Consecutive mappings are mostly of the same file
+    std::optional<dev_t> last;
+    auto check = [&](dev_t dev) {
+        if (last == dev) return false;
+        last = dev;
+        return fn(dev);
+    };
+
+    dev_t dev;
+    if (findMapsLine(dir_fd_, [&](const char* begin, const char* end) {
+            return parseMapsDevice(begin, end, &dev) && check(dev);
+        })) {
+        return true;
+    }
+    for (const char* name : {"cwd", "root", "exe"}) {
+        if (statDevice(dir_fd_, name, &dev) && check(dev)) return true;
+    }
+    return findFd(pid_, dir_fd_,
+                  [&](const char* name) { return statDevice(dir_fd_, name, &dev) && check(dev); });
+}
+
+bool ProcessInfo::hasTmpfsMountUnder(const std::string& prefix) {
+    android::base::unique_fd fd(openat(dir_fd_, "mounts", O_RDONLY | O_CLOEXEC));
+    auto fp = std::unique_ptr<FILE, int (*)(FILE*)>(
+            fd == -1 ? nullptr : fdopen(fd.get(), "re"), endmntent);
+    if (!fp) {
+        PLOG(WARNING) << "Failed to open /proc/" << pid_ << "/mounts";
+        return false;
+    }
+    fd.release();
+
+    mntent* mentry;
+    while ((mentry = getmntent(fp.get())) != nullptr) {
+        if (mentry->mnt_fsname != nullptr && strncmp(mentry->mnt_fsname, "tmpfs", 5) == 0 &&
+            android::base::StartsWith(mentry->mnt_dir, prefix)) {
             return true;
         }
     }
     return false;
 }
 
-// TODO: Refactor the code with KillProcessesWithOpenFiles().
-int KillProcessesWithTmpfsMounts(const std::string& prefix, int signal) {
-    std::unordered_set<pid_t> pids;
+// Pids are handed out to scan threads this many at a time, so that a few
+// processes with huge fd tables don't leave the other threads idle.
+static constexpr size_t kPidsPerClaim = 8;
+
+static constexpr unsigned int kDefaultScanThreads = 4;
+static constexpr unsigned int kMaxScanThreads = 16;
+
+static unsigned int scanThreads() {
+    return android::base::GetUintProperty("ro.vold.proc_scan_threads", kDefaultScanThreads,
+                                          kMaxScanThreads);
+}
 
+static void scanProcess(int proc_fd, pid_t pid, const std::function<bool(ProcessInfo&)>& match,
+                        std::vector<pid_t>* pids) {
+    // The process may have exited since readdir()
+    android::base::unique_fd dir_fd(openat(proc_fd, std::to_string(pid).c_str(),
+                                           O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+    if (dir_fd == -1) return;
+
+    ProcessInfo proc(pid, std::move(dir_fd));
+    if (match(proc)) pids->push_back(pid);
+}
+
+bool ScanProcesses(const std::function<bool(ProcessInfo&)>& match, std::vector<pid_t>* pids,
+                   unsigned int threads) {
     auto proc_d = std::unique_ptr<DIR, int (*)(DIR*)>(opendir("/proc"), closedir);
     if (!proc_d) {
         PLOG(ERROR) << "Failed to open proc";
-        return -1;
+        return false;
     }
 
+    std::vector<pid_t> all_pids;
     struct dirent* proc_de;
     while ((proc_de = readdir(proc_d.get())) != nullptr) {
         // We only care about valid PIDs
         pid_t pid;
         if (proc_de->d_type != DT_DIR) continue;
         if (!android::base::ParseInt(proc_de->d_name, &pid)) continue;
+        all_pids.push_back(pid);
+    }
+    int proc_fd = dirfd(proc_d.get());
 
-        // Look for references to prefix
-        std::string mounts_file(StringPrintf("/proc/%d/mounts", pid));
-        auto fp = std::unique_ptr<FILE, int (*)(FILE*)>(
-                setmntent(mounts_file.c_str(), "r"), endmntent);
-        if (!fp) {
-            PLOG(WARNING) << "Failed to open " << mounts_file;
-            continue;
-        }
+    threads = std::min<size_t>(threads, (all_pids.size() + kPidsPerClaim - 1) / kPidsPerClaim);
+    if (threads <= 1) {
+        for (pid_t pid : all_pids) scanProcess(proc_fd, pid, match, pids);
+        return true;
+    }
 
-        // Check if obb directory is mounted, and get all packages of mounted app data directory.
-        mntent* mentry;
-        while ((mentry = getmntent(fp.get())) != nullptr) {
-            if (mentry->mnt_fsname != nullptr && strncmp(mentry->mnt_fsname, "tmpfs", 5) == 0
-                    && android::base::StartsWith(mentry->mnt_dir, prefix)) {
-                pids.insert(pid);
-                break;
+    std::atomic<size_t> next_pid = 0;
+    std::vector<std::vector<pid_t>> found(threads);
+    auto worker = [&](std::vector<pid_t>* found_pids) {
+        size_t begin;
+        while ((begin = next_pid.fetch_add(kPidsPerClaim)) < all_pids.size()) {
+            size_t end = std::min(begin + kPidsPerClaim, all_pids.size());
+            for (size_t i = begin; i < end; i++) {
+                scanProcess(proc_fd, all_pids[i], match, found_pids);
             }
         }
+    };
+    std::vector<std::thread> workers;
+    for (unsigned int i = 1; i < threads; i++) workers.emplace_back(worker, &found[i]);
+    worker(&found[0]);
+    for (auto& thread : workers) thread.join();
+
+    size_t first = pids->size();
+    for (const auto& found_pids : found) {
+        pids->insert(pids->end(), found_pids.begin(), found_pids.end());
+    }
+    std::sort(pids->begin() + first, pids->end());
+    return true;
+}
+
+// Sends |signal| to |pid| through a pidfd, which is kept in |pidfds| so that
+// the caller can wait for the process to exit.  Falls back to kill() if the
+// kernel has no pidfd_open(), and then adds an invalid fd to |pidfds| instead.
+static int signalProcess(pid_t pid, int signal, std::vector<android::base::unique_fd>* pidfds) {
+    android::base::unique_fd pidfd(pidfd_open(pid, 0));
+    if (pidfd == -1 && errno != ENOSYS) {
+        return -1;
+    }
+    int ret = pidfd != -1 ? pidfd_send_signal(pidfd, signal, nullptr, 0) : kill(pid, signal);
+    if (ret == 0 && pidfds != nullptr) {
+        pidfds->push_back(std::move(pidfd));
+    }
+    return ret;
+}
+
+bool WaitForProcessesToExit(std::vector<android::base::unique_fd>* pidfds,
+                            std::chrono::milliseconds timeout) {
+    auto deadline = std::chrono::steady_clock::now() + timeout;
+    std::vector<struct pollfd> fds;
+    bool untracked = false;
+    for (const auto& pidfd : *pidfds) {
+        if (pidfd == -1) {
+            untracked = true;
+        } else {
+            fds.push_back({.fd = pidfd.get(), .events = POLLIN, .revents = 0});
+        }
+    }
+
+    // A pidfd becomes readable once its process has exited
+    bool exited = true;
+    while (!fds.empty()) {
+        auto remaining = std::chrono::ceil<std::chrono::milliseconds>(
+                deadline - std::chrono::steady_clock::now());
+        if (remaining.count() <= 0) {
+            exited = false;
+            break;
+        }
+        int ret = poll(fds.data(), fds.size(), remaining.count());
+        if (ret < 0) {
+            if (errno == EINTR) continue;
+            PLOG(ERROR) << "Failed to poll pidfds";
+            exited = false;
+            break;
+        }
+        fds.erase(std::remove_if(fds.begin(), fds.end(),
+                                 [](const struct pollfd& fd) { return fd.revents != 0; }),
+                  fds.end());
+    }
+    if (untracked) {
+        std::this_thread::sleep_until(deadline);
+    }
+    pidfds->clear();
+    return exited;
+}
+
+int KillProcessesWithTmpfsMounts(const std::string& prefix, int signal,
+                                 std::vector<android::base::unique_fd>* pidfds) {
+    std::vector<pid_t> pids;
+    if (!ScanProcesses(
+                [&](ProcessInfo& proc) {
+                    // Check if obb directory is mounted, and get all packages of mounted app
+                    // data directory.
+                    return proc.hasTmpfsMountUnder(prefix);
+                },
+                &pids, scanThreads())) {
+        return -1;
     }
     if (signal != 0) {
         for (const auto& pid : pids) {
             LOG(WARNING) << "Killing pid "<< pid << " with signal " << strsignal(signal) <<
                     " because it has a mount with prefix " << prefix;
-            kill(pid, signal);
+            signalProcess(pid, signal, pidfds);
         }
     }
     return pids.size();
 }
 
-int KillProcessesWithOpenFiles(const std::string& prefix, int signal, bool killFuseDaemon) {
-    std::unordered_set<pid_t> pids;
-
-    auto proc_d = std::unique_ptr<DIR, int (*)(DIR*)>(opendir("/proc"), closedir);
-    if (!proc_d) {
-        PLOG(ERROR) << "Failed to open proc";
+int KillProcessesWithOpenFiles(const std::string& prefix, int signal, bool killFuseDaemon,
+                               std::vector<android::base::unique_fd>* pidfds) {
+    std::vector<pid_t> pids;
+    if (!ScanProcesses(
+                [&](ProcessInfo& proc) {
+                    // Look for references to prefix
+                    if (!proc.hasOpenFilesUnder(prefix)) return false;
+                    if (!IsFuseDaemon(proc.pid()) || killFuseDaemon) return true;
+                    LOG(WARNING) << "Found FUSE daemon with open file. Skipping...";
+                    return false;
+                },
+                &pids, scanThreads())) {
         return -1;
     }
-
-    struct dirent* proc_de;
-    while ((proc_de = readdir(proc_d.get())) != nullptr) {
-        // We only care about valid PIDs
-        pid_t pid;
-        if (proc_de->d_type != DT_DIR) continue;
-        if (!android::base::ParseInt(proc_de->d_name, &pid)) continue;
-
-        // Look for references to prefix
-        bool found = false;
-        auto path = StringPrintf("/proc/%d", pid);
-        found |= checkMaps(path + "/maps", prefix);
-        found |= checkSymlink(path + "/cwd", prefix);
-        found |= checkSymlink(path + "/root", prefix);
-        found |= checkSymlink(path + "/exe", prefix);
-
-        auto fd_path = path + "/fd";
-        auto fd_d = std::unique_ptr<DIR, int (*)(DIR*)>(opendir(fd_path.c_str()), closedir);
-        if (!fd_d) {
-            PLOG(WARNING) << "Failed to open " << fd_path;
-        } else {
-            struct dirent* fd_de;
-            while ((fd_de = readdir(fd_d.get())) != nullptr) {
-                if (fd_de->d_type != DT_LNK) continue;
-                found |= checkSymlink(fd_path + "/" + fd_de->d_name, prefix);
-            }
-        }
-
-        if (found) {
-            if (!IsFuseDaemon(pid) || killFuseDaemon) {
-                pids.insert(pid);
-            } else {
-                LOG(WARNING) << "Found FUSE daemon with open file. Skipping...";
-            }
-        }
-    }
     int totalKilledPids = pids.size();
     if (signal != 0) {
         for (const auto& pid : pids) {
@@ -185,7 +447,7 @@ int KillProcessesWithOpenFiles(const std::string& prefix, int signal, bool killF
 
             LOG(WARNING) << "Sending " << strsignal(signal) << " to pid " << pid << " (" << comm
                          << ", " << exe << ")";
-            if (kill(pid, signal) < 0) {
+            if (signalProcess(pid, signal, pidfds) < 0) {
                 if (errno == ESRCH) {
                     totalKilledPids--;
                     LOG(WARNING) << "The target pid " << pid << " was already killed";
@@ -198,5 +460,127 @@ int KillProcessesWithOpenFiles(const std::string& prefix, int signal, bool killF
     return totalKilledPids;
 }
 
+// Undoes the octal escapes of spaces and the like in /proc/<pid>/mountinfo.
+static std::string unescapeMountPoint(const std::string& escaped) {
+    std::string result;
+    for (size_t i = 0; i < escaped.size(); i++) {
+        if (escaped[i] == '\\' && i + 3 < escaped.size() && isdigit(escaped[i + 1]) &&
+            isdigit(escaped[i + 2]) && isdigit(escaped[i + 3])) {
+            result += static_cast<char>((escaped[i + 1] - '0') * 64 + (escaped[i + 2] - '0') * 8 +
+                                        (escaped[i + 3] - '0'));
+            i += 3;
+        } else {
+            result += escaped[i];
+        }
+    }
+    return result;
+}
+
+static bool isMountUnder(const std::string& mount_point, const std::string& path) {
+    return mount_point == path || android::base::StartsWith(mount_point, path + "/");
+}
+
+bool FindProcessesUsingMounts(const std::vector<std::string>& mount_points,
+                              std::vector<std::vector<pid_t>>* pids) {
+    pids->assign(mount_points.size(), {});
+
+    std::string mountinfo;
+    if (!android::base::ReadFileToString("/proc/self/mountinfo", &mountinfo)) {
+        PLOG(ERROR) << "Failed to read mountinfo";
+        return false;
+    }
+
+    // The devices mounted under each of mount_points, and the devices that are
+    // also mounted somewhere else
+    std::vector<std::vector<dev_t>> devs(mount_points.size());
+    std::unordered_set<dev_t> shared;
+    for (const auto& line : android::base::Split(mountinfo, "\n")) {
+        auto fields = android::base::Split(line, " ");
+        unsigned int major, minor;
+        if (fields.size() < 5 || sscanf(fields[2].c_str(), "%u:%u", &major, &minor) != 2) {
+            continue;
+        }
+        dev_t dev = makedev(major, minor);
+        std::string mount_point = unescapeMountPoint(fields[4]);
+        bool owned = false;
+        for (size_t i = 0; i < mount_points.size(); i++) {
+            if (isMountUnder(mount_point, mount_points[i])) {
+                devs[i].push_back(dev);
+                owned = true;
+            }
+        }
+        if (!owned) shared.insert(dev);
+    }
+
+    // A device also mounted outside mount_points, such as a bind mount of a
+    // directory of /data, would match processes that have nothing to do with
+    // these mounts, so those mount points are matched by path prefix instead.
+    std::unordered_map<dev_t, std::vector<size_t>> owners;
+    std::vector<size_t> by_path;
+    for (size_t i = 0; i < mount_points.size(); i++) {
+        if (std::any_of(devs[i].begin(), devs[i].end(),
+                        [&](dev_t dev) { return shared.count(dev) != 0; })) {
+            by_path.push_back(i);
+        } else {
+            for (dev_t dev : devs[i]) owners[dev].push_back(i);
+        }
+    }
+
+    std::mutex lock;
+    std::vector<pid_t> unused;
+    return ScanProcesses(
+            [&](ProcessInfo& proc) {
+                std::vector<bool> found(mount_points.size());
+                if (!owners.empty()) {
+                    proc.findFileDevice([&](dev_t dev) {
+                        auto it = owners.find(dev);
+                        if (it != owners.end()) {
+                            for (size_t i : it->second) found[i] = true;
+                        }
+                        return false;
+                    });
+                }
+                for (size_t i : by_path) {
+                    if (proc.hasOpenFilesUnder(mount_points[i])) found[i] = true;
+                }
+
+                std::lock_guard<std::mutex> guard(lock);
+                for (size_t i = 0; i < mount_points.size(); i++) {
+                    if (found[i]) (*pids)[i].push_back(proc.pid());
+                }
+                return false;
+            },
+            &unused, scanThreads());
+}
+
+int KillProcessesUsingMounts(const std::vector<std::string>& mount_points, int signal,
+                             std::vector<android::base::unique_fd>* pidfds) {
+    std::vector<std::vector<pid_t>> pids;
+    if (!FindProcessesUsingMounts(mount_points, &pids)) {
+        return -1;
+    }
+    std::set<pid_t> all_pids;
+    for (size_t i = 0; i < mount_points.size(); i++) {
+        for (pid_t pid : pids[i]) {
+            if (all_pids.insert(pid).second) {
+                LOG(WARNING) << "Sending " << strsignal(signal) << " to pid " << pid
+                             << " because it uses " << mount_points[i];
+            }
+        }
+    }
+
+    int totalKilledPids = all_pids.size();
+    for (pid_t pid : all_pids) {
+        if (signalProcess(pid, signal, pidfds) < 0) {
+            if (errno == ESRCH) {
+                totalKilledPids--;
+                continue;
+            }
+            PLOG(ERROR) << "Unable to send signal " << strsignal(signal) << " to pid " << pid;
+        }
+    }
+    return totalKilledPids;
+}
+
 }  // namespace vold
 }  // namespace android
@@ -17,11 +17,85 @@
 #ifndef _PROCESS_H
 #define _PROCESS_H
 
+#include <sys/types.h>
+
+#include <chrono>
+#include <functional>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include <android-base/unique_fd.h>
+
 namespace android {
 namespace vold {
 
-int KillProcessesWithOpenFiles(const std::string& path, int signal, bool killFuseDaemon = true);
-int KillProcessesWithTmpfsMounts(const std::string& path, int signal);
+// A process seen while scanning /proc.  Its /proc/<pid> directory is opened
+// once, everything else is read relative to it, and each field is read only
+// when first asked for and then kept for the rest of the scan.
+class ProcessInfo {
+  public:
+    ProcessInfo(pid_t pid, android::base::unique_fd dir_fd)
+        : pid_(pid), dir_fd_(std::move(dir_fd)) {}
+
+    pid_t pid() const { return pid_; }
+
+    // The target of the exe link, or "" if it can't be read.
+    const std::string& exe();
+    const std::string& cwd();
+    const std::string& root();
+
+    // Whether the process maps, has open, or has its cwd, root or exe under |prefix|.
+    bool hasOpenFilesUnder(const std::string& prefix);
+    // Whether the process's mount namespace has a tmpfs mounted under |prefix|.
+    bool hasTmpfsMountUnder(const std::string& prefix);
+    // Calls |fn| with the device of each file the process maps or has open,
+    // and of its cwd, root and exe, until it returns true.  Returns whether it did.
+    bool findFileDevice(const std::function<bool(dev_t)>& fn);
+
+  private:
+    const std::string& link(const char* name, std::optional<std::string>* cache);
+
+    pid_t pid_;
+    android::base::unique_fd dir_fd_;
+    std::optional<std::string> exe_;
+    std::optional<std::string> cwd_;
+    std::optional<std::string> root_;
+};
+
+// Calls |match| once for every process in /proc, and adds the pids it returns
+// true for to |pids|.  Returns false if /proc can't be read.
+//
+// With |threads| > 1 the processes are shared out among that many threads, so
+// |match| must be safe to call concurrently, and the pids are added in order.
+bool ScanProcesses(const std::function<bool(ProcessInfo&)>& match, std::vector<pid_t>* pids,
+                   unsigned int threads = 1);
+
+// These return how many processes were sent |signal|.  If |pidfds| isn't null,
+// a pidfd for each of them is added to it, for WaitForProcessesToExit().
+int KillProcessesWithOpenFiles(const std::string& path, int signal, bool killFuseDaemon = true,
+                               std::vector<android::base::unique_fd>* pidfds = nullptr);
+int KillProcessesWithTmpfsMounts(const std::string& path, int signal,
+                                 std::vector<android::base::unique_fd>* pidfds = nullptr);
+
+// Finds the processes that use each of |mount_points|, or a mount beneath it,
+// in a single scan of /proc: (*pids)[i] gets those using |mount_points|[i].
+// Files are matched by device, which also catches processes that see the
+// filesystem at another path in their own mount namespace.  A mount whose
+// device is also mounted outside |mount_points| falls back to matching path
+// prefixes, like KillProcessesWithOpenFiles().
+bool FindProcessesUsingMounts(const std::vector<std::string>& mount_points,
+                              std::vector<std::vector<pid_t>>* pids);
+// Sends |signal| to every process FindProcessesUsingMounts() finds.
+int KillProcessesUsingMounts(const std::vector<std::string>& mount_points, int signal,
+                             std::vector<android::base::unique_fd>* pidfds = nullptr);
+
+// Waits until every process in |pidfds| has exited, or for |timeout|, and
+// clears |pidfds|.  Returns whether they all exited.  Processes that were
+// signalled without a pidfd, on kernels without pidfd_open(), can't be waited
+// for, so their presence makes this wait for the whole |timeout|.
+bool WaitForProcessesToExit(std::vector<android::base::unique_fd>* pidfds,
+                            std::chrono::milliseconds timeout);
 
 }  // namespace vold
 }  // namespace android
@@ -474,51 +474,128 @@ status_t PrepareDir(const std::string& path, mode_t mode, uid_t uid, gid_t gid,
     return OK;
 }
 
+// How long to give processes to exit after each signal, and apps to close
+// their files after an eject request, before trying harder.
+static constexpr std::chrono::seconds kKillTimeout{5};
+static constexpr std::chrono::milliseconds kUnmountRetryInterval{100};
+
+static bool tryUnmount(const char* cpath) {
+    return !umount2(cpath, UMOUNT_NOFOLLOW) || errno == EINVAL || errno == ENOENT;
+}
+
+// Waits for the processes in |pidfds| to exit, if we are waiting at all.
+static void waitForKilledProcesses(std::vector<unique_fd>* pidfds) {
+    if (sSleepOnUnmount) {
+        WaitForProcessesToExit(pidfds, kKillTimeout);
+    } else {
+        pidfds->clear();
+    }
+}
+
 status_t ForceUnmount(const std::string& path) {
     const char* cpath = path.c_str();
-    if (!umount2(cpath, UMOUNT_NOFOLLOW) || errno == EINVAL || errno == ENOENT) {
+    if (tryUnmount(cpath)) {
         return OK;
     }
     // Apps might still be handling eject request, so wait before
-    // we start sending signals
-    if (sSleepOnUnmount) sleep(5);
+    // we start sending signals, but stop as soon as they are done
+    if (sSleepOnUnmount) {
+        auto deadline = std::chrono::steady_clock::now() + kKillTimeout;
+        while (std::chrono::steady_clock::now() < deadline) {
+            std::this_thread::sleep_for(kUnmountRetryInterval);
+            if (tryUnmount(cpath)) {
+                return OK;
+            }
+        }
+    }
 
-    KillProcessesWithOpenFiles(path, SIGINT);
-    if (sSleepOnUnmount) sleep(5);
-    if (!umount2(cpath, UMOUNT_NOFOLLOW) || errno == EINVAL || errno == ENOENT) {
+    std::vector<unique_fd> pidfds;
+    KillProcessesWithOpenFiles(path, SIGINT, true /* killFuseDaemon */, &pidfds);
+    waitForKilledProcesses(&pidfds);
+    if (tryUnmount(cpath)) {
         return OK;
     }
 
-    KillProcessesWithOpenFiles(path, SIGTERM);
-    if (sSleepOnUnmount) sleep(5);
-    if (!umount2(cpath, UMOUNT_NOFOLLOW) || errno == EINVAL || errno == ENOENT) {
+    KillProcessesWithOpenFiles(path, SIGTERM, true /* killFuseDaemon */, &pidfds);
+    waitForKilledProcesses(&pidfds);
+    if (tryUnmount(cpath)) {
         return OK;
     }
 
-    KillProcessesWithOpenFiles(path, SIGKILL);
-    if (sSleepOnUnmount) sleep(5);
-    if (!umount2(cpath, UMOUNT_NOFOLLOW) || errno == EINVAL || errno == ENOENT) {
+    KillProcessesWithOpenFiles(path, SIGKILL, true /* killFuseDaemon */, &pidfds);
+    waitForKilledProcesses(&pidfds);
+    if (tryUnmount(cpath)) {
         return OK;
     }
     PLOG(INFO) << "ForceUnmount failed";
     return -errno;
 }
 
+// Unmounts what it can of |paths|, in order, and leaves the rest in |paths|.
+// Returns the errno of the last failure.
+static int tryUnmountAll(std::vector<std::string>* paths) {
+    int error = 0;
+    std::vector<std::string> busy;
+    for (auto& path : *paths) {
+        if (!tryUnmount(path.c_str())) {
+            error = errno;
+            busy.push_back(std::move(path));
+        }
+    }
+    *paths = std::move(busy);
+    return error;
+}
+
+status_t ForceUnmountAll(const std::vector<std::string>& paths) {
+    std::vector<std::string> busy = paths;
+    int error = tryUnmountAll(&busy);
+    if (busy.empty()) {
+        return OK;
+    }
+    // Apps might still be handling eject request, so wait before
+    // we start sending signals, but stop as soon as they are done
+    if (sSleepOnUnmount) {
+        auto deadline = std::chrono::steady_clock::now() + kKillTimeout;
+        while (std::chrono::steady_clock::now() < deadline) {
+            std::this_thread::sleep_for(kUnmountRetryInterval);
+            error = tryUnmountAll(&busy);
+            if (busy.empty()) {
+                return OK;
+            }
+        }
+    }
+
+    std::vector<unique_fd> pidfds;
+    for (int signal : {SIGINT, SIGTERM, SIGKILL}) {
+        KillProcessesUsingMounts(busy, signal, &pidfds);
+        waitForKilledProcesses(&pidfds);
+        error = tryUnmountAll(&busy);
+        if (busy.empty()) {
+            return OK;
+        }
+    }
+    for (const auto& path : busy) {
+        LOG(INFO) << "ForceUnmount failed on " << path << ": " << strerror(error);
+    }
+    return -error;
+}
+
 status_t KillProcessesWithTmpfsMountPrefix(const std::string& path) {
-    if (KillProcessesWithTmpfsMounts(path, SIGINT) == 0) {
+    std::vector<unique_fd> pidfds;
+    if (KillProcessesWithTmpfsMounts(path, SIGINT, &pidfds) == 0) {
         return OK;
     }
-    if (sSleepOnUnmount) sleep(5);
+    waitForKilledProcesses(&pidfds);
 
-    if (KillProcessesWithTmpfsMounts(path, SIGTERM) == 0) {
+    if (KillProcessesWithTmpfsMounts(path, SIGTERM, &pidfds) == 0) {
         return OK;
     }
-    if (sSleepOnUnmount) sleep(5);
+    waitForKilledProcesses(&pidfds);
 
-    if (KillProcessesWithTmpfsMounts(path, SIGKILL) == 0) {
+    if (KillProcessesWithTmpfsMounts(path, SIGKILL, &pidfds) == 0) {
         return OK;
     }
-    if (sSleepOnUnmount) sleep(5);
+    waitForKilledProcesses(&pidfds);
 
     // Send SIGKILL a second time to determine if we've
     // actually killed everyone mount
@@ -530,20 +607,21 @@ status_t KillProcessesWithTmpfsMountPrefix(const std::string& path) {
 }
 
 status_t KillProcessesUsingPath(const std::string& path) {
-    if (KillProcessesWithOpenFiles(path, SIGINT, false /* killFuseDaemon */) == 0) {
+    std::vector<unique_fd> pidfds;
+    if (KillProcessesWithOpenFiles(path, SIGINT, false /* killFuseDaemon */, &pidfds) == 0) {
         return OK;
     }
-    if (sSleepOnUnmount) sleep(5);
+    waitForKilledProcesses(&pidfds);
 
-    if (KillProcessesWithOpenFiles(path, SIGTERM, false /* killFuseDaemon */) == 0) {
+    if (KillProcessesWithOpenFiles(path, SIGTERM, false /* killFuseDaemon */, &pidfds) == 0) {
         return OK;
     }
-    if (sSleepOnUnmount) sleep(5);
+    waitForKilledProcesses(&pidfds);
 
-    if (KillProcessesWithOpenFiles(path, SIGKILL, false /* killFuseDaemon */) == 0) {
+    if (KillProcessesWithOpenFiles(path, SIGKILL, false /* killFuseDaemon */, &pidfds) == 0) {
         return OK;
     }
-    if (sSleepOnUnmount) sleep(5);
+    waitForKilledProcesses(&pidfds);
 
     // Send SIGKILL a second time to determine if we've
     // actually killed everyone with open files
@@ -79,6 +79,10 @@ status_t PrepareDir(const std::string& path, mode_t mode, uid_t uid, gid_t gid,
 /* Really unmounts the path, killing active processes along the way */
 status_t ForceUnmount(const std::string& path);
 
+/* Like ForceUnmount() on each of |paths| in order, but scans /proc once per
+ * signal for all of them, and waits for all of them at once */
+status_t ForceUnmountAll(const std::vector<std::string>& paths);
+
 /* Kills any processes using given path */
 status_t KillProcessesUsingPath(const std::string& path);
 
@@ -25,6 +25,7 @@
 #include <private/android_filesystem_config.h>
 #include <utils/Trace.h>
 
+#include <inttypes.h>
 #include <stdio.h>
 #include <fstream>
 #include <thread>
@@ -114,6 +115,29 @@ static binder::Status translateBool(bool status) {
     std::lock_guard<std::mutex> lock(VolumeManager::Instance()->getCryptLock()); \
     ATRACE_CALL();
 
+::android::os::CheckpointMetrics collectCheckpointMetrics() {
+    ::android::os::CheckpointMetrics metrics;
+    CheckpointRestoreStats stats = cp_getRestoreStats();
+    metrics.restoreDevice = stats.device;
+    metrics.logSectors = stats.log_sectors;
+    metrics.logEntries = stats.log_entries;
+    metrics.bytesRead = stats.bytes_read;
+    metrics.bytesReused = stats.bytes_reused;
+    metrics.bytesRelocated = stats.bytes_relocated;
+    metrics.markers = stats.markers;
+    metrics.fsyncs = stats.fsyncs;
+    metrics.validateMillis = stats.validate_ms;
+    metrics.restoreMillis = stats.restore_ms;
+
+    uint64_t min_free_bytes;
+    if (cp_getMinFreeSpace(&min_free_bytes, &metrics.minFreeMountPoint)) {
+        metrics.minFreeBytesSeen = min_free_bytes;
+    } else {
+        metrics.minFreeBytesSeen = -1;
+    }
+    return metrics;
+}
+
 }  // namespace
 
 status_t VoldNativeService::start() {
@@ -137,6 +161,33 @@ status_t VoldNativeService::dump(int fd, const Vector<String16>& /* args */) {
 
     ACQUIRE_LOCK;
     dprintf(fd, "vold is happy!\n");
+
+    dprintf(fd, "\nCheckpoint:\n");
+    dprintf(fd, "  checkpointing: %s\n", cp_isCheckpointing() ? "true" : "false");
+    auto metrics = collectCheckpointMetrics();
+    if (!metrics.restoreDevice.empty()) {
+        dprintf(fd,
+                "  last restore of %s: %d log sectors, %" PRId64 " entries, validate %" PRId64
+                " ms, restore %" PRId64 " ms\n",
+                metrics.restoreDevice.c_str(), metrics.logSectors, metrics.logEntries,
+                metrics.validateMillis, metrics.restoreMillis);
+        dprintf(fd,
+                "    read %" PRId64 " bytes, reused %" PRId64 " bytes, relocated %" PRId64
+                " bytes, %d markers, %d fsyncs\n",
+                metrics.bytesRead, metrics.bytesReused, metrics.bytesRelocated, metrics.markers,
+                metrics.fsyncs);
+    }
+    if (metrics.minFreeBytesSeen >= 0) {
+        dprintf(fd, "  least free space: %" PRId64 " bytes on %s\n", metrics.minFreeBytesSeen,
+                metrics.minFreeMountPoint.c_str());
+    }
+    for (const auto& health : cp_getHealth()) {
+        dprintf(fd,
+                "  %s: %" PRIu64 " bytes free, using %" PRIu64 " bytes/s, next sample in %" PRId64
+                " ms\n",
+                health.mount_point.c_str(), health.free_bytes, health.consumption_rate,
+                health.poll_interval_ms);
+    }
     return NO_ERROR;
 }
 
@@ -828,6 +879,32 @@ binder::Status VoldNativeService::resetCheckpoint() {
     return Ok();
 }
 
+binder::Status VoldNativeService::getCheckpointHealth(
+        std::vector<::android::os::CheckpointHealthSample>* _aidl_return) {
+    ENFORCE_SYSTEM_OR_ROOT;
+
+    _aidl_return->clear();
+    for (const auto& health : cp_getHealth()) {
+        ::android::os::CheckpointHealthSample sample;
+        sample.mountPoint = health.mount_point;
+        sample.freeBytes = health.free_bytes;
+        sample.minFreeBytes = health.min_free_bytes;
+        sample.consumptionBytesPerSec = health.consumption_rate;
+        sample.sampleTimeMillis = health.time_ms;
+        sample.pollIntervalMillis = health.poll_interval_ms;
+        _aidl_return->push_back(std::move(sample));
+    }
+    return Ok();
+}
+
+binder::Status VoldNativeService::getCheckpointMetrics(
+        ::android::os::CheckpointMetrics* _aidl_return) {
+    ENFORCE_SYSTEM_OR_ROOT;
+
+    *_aidl_return = collectCheckpointMetrics();
+    return Ok();
+}
+
 static void initializeIncFs() {
     // Obtaining IncFS features triggers initialization of IncFS.
     incfs::features();
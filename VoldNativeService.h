@@ -148,6 +148,9 @@ class VoldNativeService : public BinderService<VoldNativeService>, public os::Bn
     binder::Status supportsBlockCheckpoint(bool* _aidl_return);
     binder::Status supportsFileCheckpoint(bool* _aidl_return);
     binder::Status resetCheckpoint();
+    binder::Status getCheckpointHealth(
+            std::vector<::android::os::CheckpointHealthSample>* _aidl_return);
+    binder::Status getCheckpointMetrics(::android::os::CheckpointMetrics* _aidl_return);
 
     binder::Status earlyBootEnded();
 
@@ -106,8 +106,6 @@ static const unsigned int kSizeVirtualDisk = 536870912;
 
 static const unsigned int kMajorBlockMmc = 179;
 
-using ScanProcCallback = bool(*)(uid_t uid, pid_t pid, int nsFd, const char* name, void* params);
-
 VolumeManager* VolumeManager::sInstance = NULL;
 
 VolumeManager* VolumeManager::Instance() {
@@ -522,192 +520,6 @@ int VolumeManager::onSecureKeyguardStateChanged(bool isShowing) {
     return 0;
 }
 
-// This code is executed after a fork so it's very important that the set of
-// methods we call here is strictly limited.
-//
-// TODO: Get rid of this guesswork altogether and instead exec a process
-// immediately after fork to do our bindding for us.
-static bool childProcess(const char* storageSource, const char* userSource, int nsFd,
-                         const char* name) {
-    if (setns(nsFd, CLONE_NEWNS) != 0) {
-        async_safe_format_log(ANDROID_LOG_ERROR, "vold", "Failed to setns for %s :%s", name,
-                              strerror(errno));
-        return false;
-    }
-
-    // NOTE: Inlined from vold::UnmountTree here to avoid using PLOG methods and
-    // to also protect against future changes that may cause issues across a
-    // fork.
-    if (TEMP_FAILURE_RETRY(umount2("/storage/", MNT_DETACH)) < 0 && errno != EINVAL &&
-        errno != ENOENT) {
-        async_safe_format_log(ANDROID_LOG_ERROR, "vold", "Failed to unmount /storage/ :%s",
-                              strerror(errno));
-        return false;
-    }
-
-    if (TEMP_FAILURE_RETRY(mount(storageSource, "/storage", NULL, MS_BIND | MS_REC, NULL)) == -1) {
-        async_safe_format_log(ANDROID_LOG_ERROR, "vold", "Failed to mount %s for %s :%s",
-                              storageSource, name, strerror(errno));
-        return false;
-    }
-
-    if (TEMP_FAILURE_RETRY(mount(NULL, "/storage", NULL, MS_REC | MS_SLAVE, NULL)) == -1) {
-        async_safe_format_log(ANDROID_LOG_ERROR, "vold",
-                              "Failed to set MS_SLAVE to /storage for %s :%s", name,
-                              strerror(errno));
-        return false;
-    }
-
-    if (TEMP_FAILURE_RETRY(mount(userSource, "/storage/self", NULL, MS_BIND, NULL)) == -1) {
-        async_safe_format_log(ANDROID_LOG_ERROR, "vold", "Failed to mount %s for %s :%s",
-                              userSource, name, strerror(errno));
-        return false;
-    }
-
-    return true;
-}
-
-// Fork the process and remount storage
-bool forkAndRemountChild(uid_t uid, pid_t pid, int nsFd, const char* name, void* params) {
-    int32_t mountMode = *static_cast<int32_t*>(params);
-    std::string userSource;
-    std::string storageSource;
-    pid_t child;
-    // Need to fix these paths to account for when sdcardfs is gone
-    switch (mountMode) {
-        case VoldNativeService::REMOUNT_MODE_NONE:
-            return true;
-        case VoldNativeService::REMOUNT_MODE_DEFAULT:
-            storageSource = "/mnt/runtime/default";
-            break;
-        case VoldNativeService::REMOUNT_MODE_ANDROID_WRITABLE:
-        case VoldNativeService::REMOUNT_MODE_INSTALLER:
-            storageSource = "/mnt/runtime/write";
-            break;
-        case VoldNativeService::REMOUNT_MODE_PASS_THROUGH:
-            return true;
-        default:
-            PLOG(ERROR) << "Unknown mode " << std::to_string(mountMode);
-            return false;
-    }
-    LOG(DEBUG) << "Remounting " << uid << " as " << storageSource;
-
-    // Fork a child to mount user-specific symlink helper into place
-    userSource = StringPrintf("/mnt/user/%d", multiuser_get_user_id(uid));
-    if (!(child = fork())) {
-        if (childProcess(storageSource.c_str(), userSource.c_str(), nsFd, name)) {
-            _exit(0);
-        } else {
-            _exit(1);
-        }
-    }
-
-    if (child == -1) {
-        PLOG(ERROR) << "Failed to fork";
-        return false;
-    } else {
-        TEMP_FAILURE_RETRY(waitpid(child, nullptr, 0));
-    }
-    return true;
-}
-
-// Helper function to scan all processes in /proc and call the callback if:
-// 1). pid belongs to an app process
-// 2). If input uid is 0 or it matches the process uid
-// 3). If userId is not -1 or userId matches the process userId
-bool scanProcProcesses(uid_t uid, userid_t userId, ScanProcCallback callback, void* params) {
-    DIR* dir;
-    struct dirent* de;
-    std::string rootName;
-    std::string pidName;
-    std::string exeName;
-    int pidFd;
-    int nsFd;
-    struct stat sb;
-
-    if (!(dir = opendir("/proc"))) {
-        async_safe_format_log(ANDROID_LOG_ERROR, "vold", "Failed to opendir");
-        return false;
-    }
-
-    // Figure out root namespace to compare against below
-    if (!android::vold::Readlinkat(dirfd(dir), "1/ns/mnt", &rootName)) {
-        async_safe_format_log(ANDROID_LOG_ERROR, "vold", "Failed to read root namespace");
-        closedir(dir);
-        return false;
-    }
-
-    async_safe_format_log(ANDROID_LOG_INFO, "vold", "Start scanning all processes");
-    // Poke through all running PIDs look for apps running as UID
-    while ((de = readdir(dir))) {
-        pid_t pid;
-        if (de->d_type != DT_DIR) continue;
-        if (!android::base::ParseInt(de->d_name, &pid)) continue;
-
-        pidFd = -1;
-        nsFd = -1;
-
-        pidFd = openat(dirfd(dir), de->d_name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
-        if (pidFd < 0) {
-            goto next;
-        }
-        if (fstat(pidFd, &sb) != 0) {
-            async_safe_format_log(ANDROID_LOG_ERROR, "vold", "Failed to stat %s", de->d_name);
-            goto next;
-        }
-        if (uid != 0 && sb.st_uid != uid) {
-            goto next;
-        }
-        if (userId != static_cast<userid_t>(-1) && multiuser_get_user_id(sb.st_uid) != userId) {
-            goto next;
-        }
-
-        // Matches so far, but refuse to touch if in root namespace
-        if (!android::vold::Readlinkat(pidFd, "ns/mnt", &pidName)) {
-            async_safe_format_log(ANDROID_LOG_ERROR, "vold",
-                    "Failed to read namespacefor %s", de->d_name);
-            goto next;
-        }
-        if (rootName == pidName) {
-            goto next;
-        }
-
-        // Some early native processes have mount namespaces that are different
-        // from that of the init. Therefore, above check can't filter them out.
-        // Since the propagation type of / is 'shared', unmounting /storage
-        // for the early native processes affects other processes including
-        // init. Filter out such processes by skipping if a process is a
-        // non-Java process whose UID is < AID_APP_START. (The UID condition
-        // is required to not filter out child processes spawned by apps.)
-        if (!android::vold::Readlinkat(pidFd, "exe", &exeName)) {
-            goto next;
-        }
-        if (!StartsWith(exeName, "/system/bin/app_process") && sb.st_uid < AID_APP_START) {
-            goto next;
-        }
-
-        // We purposefully leave the namespace open across the fork
-        // NOLINTNEXTLINE(android-cloexec-open): Deliberately not O_CLOEXEC
-        nsFd = openat(pidFd, "ns/mnt", O_RDONLY);
-        if (nsFd < 0) {
-            async_safe_format_log(ANDROID_LOG_ERROR, "vold",
-                    "Failed to open namespace for %s", de->d_name);
-            goto next;
-        }
-
-        if (!callback(sb.st_uid, pid, nsFd, de->d_name, params)) {
-            async_safe_format_log(ANDROID_LOG_ERROR, "vold", "Failed in callback");
-        }
-
-    next:
-        close(nsFd);
-        close(pidFd);
-    }
-    closedir(dir);
-    async_safe_format_log(ANDROID_LOG_INFO, "vold", "Finished scanning all processes");
-    return true;
-}
-
 // In each app's namespace, unmount obb and data dirs
 static bool umountStorageDirs(int nsFd, const char* android_data_dir, const char* android_obb_dir,
         int uid, const char* targets[], int size) {
@@ -1046,8 +858,8 @@ int VolumeManager::unmountAll() {
 
     for (const auto& path : toUnmount) {
         LOG(DEBUG) << "Tearing down stale mount " << path;
-        android::vold::ForceUnmount(path);
     }
+    android::vold::ForceUnmountAll({toUnmount.begin(), toUnmount.end()});
 
     return 0;
 }
@@ -0,0 +1,457 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Benchmarks cp_restoreCheckpoint() on synthetic dm-bow logs.
+//
+// For each log size, this fills an image with random data, keeps a copy of it
+// as the golden image, and then makes random writes to it the way a filesystem
+// would during a checkpoint, logging them the way dm-bow does: the first write
+// to each block copies the old data to a block that was free when the
+// checkpoint started, and records the copy in the log sector kept in block 0.
+// Some of the writes go to blocks that hold such copies, which moves the copy
+// again, and the block may then be freed and copied to again, which makes the
+// restore deal with collisions.  The restore is timed, and must give back the
+// golden image exactly, except for the blocks that were free.
+//
+// The image is used as a file, or attached to a loop device with -l, which must
+// then run as root.
+
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include <android-base/file.h>
+#include <android-base/logging.h>
+#include <android-base/parseint.h>
+#include <android-base/strings.h>
+#include <android-base/unique_fd.h>
+
+#include "Checkpoint.h"
+#include "Crc32.h"
+#include "Loop.h"
+#include "Utils.h"
+
+using android::base::unique_fd;
+using android::vold::CheckpointRestoreStats;
+
+// The on-disk log format of dm-bow, which Checkpoint.cpp reads.
+struct log_entry {
+    uint64_t source;  // in sectors of 512 bytes
+    uint64_t dest;    // in sectors of 512 bytes
+    uint32_t size;    // in bytes
+    uint32_t checksum;
+} __attribute__((packed));
+
+struct log_sector_v1_0 {
+    uint32_t magic;
+    uint16_t header_version;
+    uint16_t header_size;
+    uint32_t block_size;
+    uint32_t count;
+    uint32_t sequence;
+    uint64_t sector0;
+} __attribute__((packed));
+
+static constexpr uint32_t kMagic = 0x00574f42;
+static constexpr uint32_t kBlockSize = 4096;
+static constexpr uint64_t kSectorsPerBlock = kBlockSize / 512;
+static constexpr uint32_t kMaxEntries = (kBlockSize - sizeof(log_sector_v1_0)) / sizeof(log_entry);
+
+struct Config {
+    uint64_t size_mb = 512;
+    std::vector<uint64_t> writes = {1000, 10000, 50000};
+    unsigned int collision_percent = 10;
+    uint64_t seed = 0;
+    bool loop = false;
+    bool generate_only = false;
+    std::string dir = "/data/local/tmp/checkpoint_restore_bench";
+};
+
+static void usage(std::ostream& os, const char* prog) {
+    os << "Usage: " << prog << " [options]\n"
+       << "  -s MB       size of the image (default 512)\n"
+       << "  -w LIST     numbers of block writes to log, e.g. 1000,10000 (default "
+          "1000,10000,50000)\n"
+       << "  -c PERCENT  how many writes move an earlier copy, causing collisions (default 10)\n"
+       << "  -r SEED     seed of the random writes (default 0)\n"
+       << "  -l          restore through a loop device instead of the image file\n"
+       << "  -g          only generate the image and golden image for the first size\n"
+       << "  -d DIR      directory for the image files\n";
+}
+
+// A set that can return a random member.
+class RandomSet {
+  public:
+    bool Contains(uint64_t value) const { return index_.count(value) != 0; }
+    bool Empty() const { return values_.empty(); }
+
+    void Insert(uint64_t value) {
+        if (index_.emplace(value, values_.size()).second) values_.push_back(value);
+    }
+
+    void Erase(uint64_t value) {
+        auto it = index_.find(value);
+        if (it == index_.end()) return;
+        values_[it->second] = values_.back();
+        index_[values_.back()] = it->second;
+        values_.pop_back();
+        index_.erase(value);
+    }
+
+    uint64_t Pick(std::mt19937_64* rng) const { return values_[(*rng)() % values_.size()]; }
+
+  private:
+    std::vector<uint64_t> values_;
+    std::unordered_map<uint64_t, size_t> index_;
+};
+
+// Makes random writes to a device, logging them the way dm-bow does.  The upper
+// half of the device is treated as free when the checkpoint starts, so it is
+// where the old data is copied to.
+class LogGenerator {
+  public:
+    LogGenerator(int fd, uint64_t blocks, uint64_t seed, unsigned int collision_percent)
+        : fd_(fd), blocks_(blocks), collision_percent_(collision_percent), rng_(seed) {
+        for (uint64_t block = blocks / 2; block < blocks; block++) free_.Insert(block);
+    }
+
+    // Starts the log, by copying block 0 so that it can hold the log sector.
+    bool Start() {
+        uint64_t dest;
+        if (!Copy(0, &dest)) return false;
+        sector0_ = dest * kSectorsPerBlock;
+        return AddEntry(0, dest);
+    }
+
+    // Writes random data to a random block.
+    bool RandomWrite() {
+        uint64_t block = 1 + rng_() % (blocks_ - 1);
+        if (!copies_.Empty() && rng_() % 100 < collision_percent_) block = copies_.Pick(&rng_);
+        return Write(block);
+    }
+
+    // Writes the current log sector to block 0.
+    bool Finish() {
+        std::vector<char> data(kBlockSize);
+        auto ls = reinterpret_cast<log_sector_v1_0*>(data.data());
+        ls->magic = kMagic;
+        ls->header_version = 1;
+        ls->header_size = sizeof(*ls);
+        ls->block_size = kBlockSize;
+        ls->count = entries_.size();
+        ls->sequence = sequence_;
+        ls->sector0 = sector0_;
+        memcpy(&data[sizeof(*ls)], entries_.data(), entries_.size() * sizeof(log_entry));
+        return WriteBlock(0, data);
+    }
+
+    uint32_t log_sectors() const { return sequence_ + 1; }
+    uint64_t log_entries() const { return log_entries_; }
+
+  private:
+    bool Write(uint64_t block) {
+        uint64_t dest;
+        bool freed = false;
+        if (copies_.Contains(block)) {
+            // The filesystem is reusing a block that dm-bow copied old data to,
+            // so the copy moves again.  Half the time the filesystem then frees
+            // the block, so it can be copied to again: restoring the later copy
+            // reads the block before restoring the earlier move writes it.
+            if (!Copy(block, &dest) || !AddEntry(block, dest)) return false;
+            copies_.Erase(block);
+            freed = rng_() % 2;
+        } else if (block < blocks_ / 2 && copied_.count(block) == 0) {
+            if (!Copy(block, &dest) || !AddEntry(block, dest)) return false;
+            copied_.insert(block);
+        } else {
+            // Free when the checkpoint started, or already copied.
+            free_.Erase(block);
+        }
+        for (auto& c : buffer_) c = rng_();
+        if (!WriteBlock(block, buffer_)) return false;
+        if (freed) free_.Insert(block);
+        return true;
+    }
+
+    // Copies |block| to a free block, which is returned in |dest|.
+    bool Copy(uint64_t block, uint64_t* dest) {
+        if (free_.Empty()) {
+            LOG(ERROR) << "Out of free blocks; use a larger image";
+            return false;
+        }
+        *dest = free_.Pick(&rng_);
+        free_.Erase(*dest);
+        copies_.Insert(*dest);
+        return ReadBlock(block, &copy_) && WriteBlock(*dest, copy_);
+    }
+
+    // Logs the copy of |block| that was just made to |dest|.
+    bool AddEntry(uint64_t block, uint64_t dest) {
+        uint32_t checksum = block;
+        android::vold::crc32(copy_.data(), kBlockSize, &checksum);
+        if (entries_.size() == kMaxEntries) {
+            // Start a new log sector, after copying the full one like any other
+            // block.
+            std::vector<char> data = copy_;
+            uint64_t ls_dest;
+            if (!Finish() || !Copy(0, &ls_dest)) return false;
+            entries_.clear();
+            sequence_++;
+            uint32_t ls_checksum = 0;
+            android::vold::crc32(copy_.data(), kBlockSize, &ls_checksum);
+            entries_.push_back({0, ls_dest * kSectorsPerBlock, kBlockSize, ls_checksum});
+            log_entries_++;
+            copy_ = data;
+        }
+        entries_.push_back(
+                {block * kSectorsPerBlock, dest * kSectorsPerBlock, kBlockSize, checksum});
+        log_entries_++;
+        return true;
+    }
+
+    bool ReadBlock(uint64_t block, std::vector<char>* data) {
+        data->resize(kBlockSize);
+        if (pread64(fd_, data->data(), kBlockSize, block * kBlockSize) != kBlockSize) {
+            PLOG(ERROR) << "Failed to read block " << block;
+            return false;
+        }
+        return true;
+    }
+
+    bool WriteBlock(uint64_t block, const std::vector<char>& data) {
+        if (pwrite64(fd_, data.data(), kBlockSize, block * kBlockSize) != kBlockSize) {
+            PLOG(ERROR) << "Failed to write block " << block;
+            return false;
+        }
+        return true;
+    }
+
+    int fd_;
+    uint64_t blocks_;
+    unsigned int collision_percent_;
+    std::mt19937_64 rng_;
+    // Blocks that were free when the checkpoint started and haven't been used.
+    RandomSet free_;
+    // Blocks that hold a copy of the old data of another block.
+    RandomSet copies_;
+    // Blocks whose old data has been copied.
+    std::unordered_set<uint64_t> copied_;
+    std::vector<log_entry> entries_;
+    uint32_t sequence_ = 0;
+    uint64_t sector0_ = 0;
+    uint64_t log_entries_ = 0;
+    std::vector<char> copy_;
+    std::vector<char> buffer_ = std::vector<char>(kBlockSize);
+};
+
+// Writes |blocks| blocks of random data to |path|.
+static bool WriteRandomImage(const std::string& path, uint64_t blocks, uint64_t seed) {
+    unique_fd fd(open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600));
+    if (fd < 0) {
+        PLOG(ERROR) << "Failed to create " << path;
+        return false;
+    }
+    std::mt19937_64 rng(seed);
+    std::vector<uint64_t> buf(256 * kBlockSize / sizeof(uint64_t));
+    for (uint64_t block = 0; block < blocks; block += 256) {
+        for (auto& word : buf) word = rng();
+        size_t n = std::min<uint64_t>(blocks - block, 256) * kBlockSize;
+        if (!android::base::WriteFully(fd, buf.data(), n)) {
+            PLOG(ERROR) << "Failed to write " << path;
+            return false;
+        }
+    }
+    return true;
+}
+
+// Creates |golden| with random data, and |image| as a copy of it on which
+// |writes| block writes have been logged.
+static bool CreateImages(const Config& config, uint64_t writes, const std::string& golden,
+                         const std::string& image, uint32_t* log_sectors, uint64_t* log_entries) {
+    uint64_t blocks = config.size_mb * 1024 * 1024 / kBlockSize;
+    if (!WriteRandomImage(golden, blocks, config.seed) ||
+        !WriteRandomImage(image, blocks, config.seed)) {
+        return false;
+    }
+
+    unique_fd fd(open(image.c_str(), O_RDWR | O_CLOEXEC));
+    if (fd < 0) {
+        PLOG(ERROR) << "Failed to open " << image;
+        return false;
+    }
+    LogGenerator generator(fd, blocks, config.seed, config.collision_percent);
+    if (!generator.Start()) return false;
+    for (uint64_t i = 0; i < writes; i++) {
+        if (!generator.RandomWrite()) return false;
+    }
+    if (!generator.Finish() || fsync(fd) != 0) return false;
+    *log_sectors = generator.log_sectors();
+    *log_entries = generator.log_entries();
+    return true;
+}
+
+// Returns the number of blocks of the lower half of |image|, which holds the
+// data that the checkpoint must preserve, that differ from |golden|.
+static int64_t CountMismatches(const std::string& golden, const std::string& image) {
+    unique_fd golden_fd(open(golden.c_str(), O_RDONLY | O_CLOEXEC));
+    unique_fd image_fd(open(image.c_str(), O_RDONLY | O_CLOEXEC));
+    if (golden_fd < 0 || image_fd < 0) {
+        PLOG(ERROR) << "Failed to open " << golden << " or " << image;
+        return -1;
+    }
+    uint64_t blocks = lseek64(golden_fd, 0, SEEK_END) / kBlockSize;
+    std::vector<char> expected(kBlockSize), actual(kBlockSize);
+    int64_t mismatches = 0;
+    for (uint64_t block = 0; block < blocks / 2; block++) {
+        if (pread64(golden_fd, expected.data(), kBlockSize, block * kBlockSize) != kBlockSize ||
+            pread64(image_fd, actual.data(), kBlockSize, block * kBlockSize) != kBlockSize) {
+            PLOG(ERROR) << "Failed to read block " << block;
+            return -1;
+        }
+        if (expected != actual) mismatches++;
+    }
+    return mismatches;
+}
+
+// Restores |image| and returns the stats of the restore.
+static bool RunOne(const Config& config, const std::string& image, CheckpointRestoreStats* stats,
+                   double* seconds) {
+    std::string device = image;
+    if (config.loop && Loop::create(image, device) != 0) return false;
+
+    sync();
+    if (!android::base::WriteStringToFile("3", "/proc/sys/vm/drop_caches"))
+        PLOG(WARNING) << "Failed to drop caches";
+
+    auto start = std::chrono::steady_clock::now();
+    auto status = android::vold::cp_restoreCheckpoint(device);
+    *seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    *stats = android::vold::cp_getRestoreStats();
+
+    if (config.loop) Loop::destroyByDevice(device.c_str());
+    if (!status.isOk()) {
+        LOG(ERROR) << "Restore failed: " << status.toString8();
+        return false;
+    }
+    return true;
+}
+
+int main(int argc, char** argv) {
+    android::base::InitLogging(argv, android::base::StderrLogger);
+    // The restore logs every log sector.
+    android::base::SetMinimumLogSeverity(android::base::WARNING);
+
+    Config config;
+    int opt;
+    while ((opt = getopt(argc, argv, "hs:w:c:r:lgd:")) != -1) {
+        bool ok = true;
+        switch (opt) {
+            case 's':
+                ok = android::base::ParseUint(optarg, &config.size_mb) && config.size_mb > 0;
+                break;
+            case 'w':
+                config.writes.clear();
+                for (const auto& item : android::base::Split(optarg, ",")) {
+                    uint64_t writes;
+                    ok = ok && android::base::ParseUint(item, &writes);
+                    config.writes.push_back(writes);
+                }
+                break;
+            case 'c':
+                ok = android::base::ParseUint(optarg, &config.collision_percent, 100u);
+                break;
+            case 'r':
+                ok = android::base::ParseUint(optarg, &config.seed);
+                break;
+            case 'l':
+                config.loop = true;
+                break;
+            case 'g':
+                config.generate_only = true;
+                break;
+            case 'd':
+                config.dir = optarg;
+                break;
+            case 'h':
+                usage(std::cout, argv[0]);
+                return EXIT_SUCCESS;
+            default:
+                ok = false;
+        }
+        if (!ok) {
+            usage(std::cerr, argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (android::vold::CreateDir(config.dir, 0700) != android::OK) return EXIT_FAILURE;
+    std::string golden = config.dir + "/golden.img";
+    std::string image = config.dir + "/checkpoint.img";
+
+    if (config.generate_only) {
+        uint32_t log_sectors;
+        uint64_t log_entries;
+        if (!CreateImages(config, config.writes[0], golden, image, &log_sectors, &log_entries))
+            return EXIT_FAILURE;
+        std::cout << "Wrote " << log_entries << " log entries in " << log_sectors
+                  << " log sectors to " << image << "; golden image is " << golden << std::endl;
+        return EXIT_SUCCESS;
+    }
+
+    std::cout << "writes\tentries\tsectors\tvalid_ms\trest_ms\tseconds\tread_MB\treused_MB\t"
+                 "written_MB\tmarkers\tfsyncs\tresult"
+              << std::endl;
+    int ret = EXIT_SUCCESS;
+    for (uint64_t writes : config.writes) {
+        uint32_t log_sectors;
+        uint64_t log_entries;
+        if (!CreateImages(config, writes, golden, image, &log_sectors, &log_entries))
+            return EXIT_FAILURE;
+
+        CheckpointRestoreStats stats;
+        double seconds = 0;
+        bool success = RunOne(config, image, &stats, &seconds);
+        int64_t mismatches = success ? CountMismatches(golden, image) : -1;
+
+        std::cout << writes << "\t" << log_entries << "\t" << log_sectors << "\t";
+        if (success) {
+            std::cout << stats.validate_ms << "\t" << stats.restore_ms << "\t" << std::fixed
+                      << std::setprecision(2) << seconds << "\t" << stats.bytes_read / 1e6
+                      << "\t" << stats.bytes_reused / 1e6 << "\t" << stats.bytes_written / 1e6
+                      << "\t" << stats.markers << "\t" << stats.fsyncs << "\t";
+        }
+        if (mismatches == 0) {
+            std::cout << "OK" << std::endl;
+        } else {
+            if (mismatches > 0) std::cout << mismatches << " blocks differ" << std::endl;
+            else std::cout << "FAILED" << std::endl;
+            ret = EXIT_FAILURE;
+        }
+    }
+    unlink(image.c_str());
+    unlink(golden.c_str());
+    return ret;
+}
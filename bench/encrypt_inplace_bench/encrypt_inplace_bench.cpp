@@ -0,0 +1,396 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Benchmarks encrypt_inplace() on a synthetic file-backed ext4, f2fs or
+// unformatted image, once for each combination of the given tuning options.
+//
+// The image is attached to a loop device, and the crypto device is either a
+// dm-crypt device on top of it, or an identity dm-linear device that writes
+// back exactly what was read.  The latter measures the I/O path without the
+// cost of the cipher.  This uses loop and device-mapper devices, so it must run
+// as root.
+//
+// After each run the crypto device is checked: ext4 images with e2fsck, and
+// every image by comparing the data read back through the crypto device with
+// the data the image was created with.  A run that fails the check is
+// reported as failed.
+
+#include <fcntl.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mount.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <android-base/file.h>
+#include <android-base/logging.h>
+#include <android-base/parseint.h>
+#include <android-base/stringprintf.h>
+#include <android-base/strings.h>
+#include <android-base/unique_fd.h>
+#include <libdm/dm.h>
+
+#include "EncryptInplace.h"
+#include "Loop.h"
+#include "Utils.h"
+
+using namespace std::chrono_literals;
+using android::base::unique_fd;
+using android::dm::DeviceMapper;
+using android::dm::DmTable;
+using android::dm::DmTargetCrypt;
+using android::dm::DmTargetLinear;
+
+static constexpr char kDmName[] = "encrypt_inplace_bench";
+// Size of each file that the filesystem images are filled with.
+static constexpr uint64_t kFileSize = 1024 * 1024;
+
+struct Config {
+    std::string fs = "ext4";
+    uint64_t size_mb = 1024;
+    unsigned int fill_percent = 50;
+    std::string target = "crypt";
+    std::string dir = "/data/local/tmp/encrypt_inplace_bench";
+    std::vector<unsigned int> threads = {1};
+    std::vector<unsigned int> queue_depths = {4};
+    std::vector<unsigned int> io_sizes_kb = {0};
+    std::vector<unsigned int> direct_io = {0};
+};
+
+static void usage(std::ostream& os, const char* prog) {
+    os << "Usage: " << prog << " [options]\n"
+       << "  -f FS       filesystem of the image: ext4, f2fs or none (default ext4)\n"
+       << "  -s MB       size of the image (default 1024)\n"
+       << "  -u PERCENT  how full the filesystem is (default 50)\n"
+       << "  -t TARGET   crypto device: crypt or linear (default crypt)\n"
+       << "  -d DIR      directory for the image files\n"
+       << "  -j LIST     thread counts, e.g. 1,2,4 (default 1)\n"
+       << "  -q LIST     queue depths (default 4)\n"
+       << "  -b LIST     I/O sizes in KiB; 0 chooses them from the queue limits (default 0)\n"
+       << "  -o LIST     I/O engines: 0 for buffered, 1 for direct I/O (default 0)\n";
+}
+
+static bool ParseList(const char* arg, std::vector<unsigned int>* out) {
+    out->clear();
+    for (const auto& item : android::base::Split(arg, ",")) {
+        unsigned int value;
+        if (!android::base::ParseUint(item, &value)) return false;
+        out->push_back(value);
+    }
+    return true;
+}
+
+static uint64_t NumFiles(const Config& config) {
+    return config.size_mb * 1024 * 1024 / kFileSize * config.fill_percent / 100;
+}
+
+static void FillRandom(std::vector<uint64_t>* buf, std::mt19937_64* rng) {
+    for (auto& word : *buf) word = (*rng)();
+}
+
+// Writes |bytes| bytes of incompressible data to |path|.
+static bool WriteRandomFile(const std::string& path, uint64_t bytes, std::mt19937_64* rng) {
+    unique_fd fd(open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600));
+    if (fd < 0) {
+        PLOG(ERROR) << "Failed to create " << path;
+        return false;
+    }
+    std::vector<uint64_t> buf(kFileSize / sizeof(uint64_t));
+    while (bytes > 0) {
+        FillRandom(&buf, rng);
+        size_t n = std::min(bytes, kFileSize);
+        if (!android::base::WriteFully(fd, buf.data(), n)) {
+            PLOG(ERROR) << "Failed to write " << path;
+            return false;
+        }
+        bytes -= n;
+    }
+    return true;
+}
+
+// Checks that the next |bytes| bytes of |fd| are the data that WriteRandomFile()
+// wrote with the same |rng| state.
+static bool CheckRandomData(int fd, const std::string& path, uint64_t bytes,
+                            std::mt19937_64* rng) {
+    std::vector<uint64_t> expected(kFileSize / sizeof(uint64_t));
+    std::vector<uint64_t> actual(expected.size());
+    uint64_t offset = 0;
+    while (offset < bytes) {
+        FillRandom(&expected, rng);
+        size_t n = std::min(bytes - offset, kFileSize);
+        if (!android::base::ReadFully(fd, actual.data(), n)) {
+            PLOG(ERROR) << "Failed to read " << path;
+            return false;
+        }
+        if (memcmp(actual.data(), expected.data(), n) != 0) {
+            LOG(ERROR) << path << " differs from the original within " << n << " bytes at offset "
+                       << offset;
+            return false;
+        }
+        offset += n;
+    }
+    return true;
+}
+
+static void DropCaches() {
+    sync();
+    if (!android::base::WriteStringToFile("3", "/proc/sys/vm/drop_caches"))
+        PLOG(WARNING) << "Failed to drop caches";
+}
+
+// Creates |image| with the configured filesystem, filled to the configured
+// percentage with files of random data.  The contents are the same every time.
+static bool CreateImage(const Config& config, const std::string& image) {
+    uint64_t size = config.size_mb * 1024 * 1024;
+    std::mt19937_64 rng(0);
+    unlink(image.c_str());
+    if (config.fs == "none") return WriteRandomFile(image, size, &rng);
+
+    std::string src_dir = config.dir + "/src";
+    if (android::vold::CreateDir(src_dir, 0700) != android::OK) return false;
+    std::vector<std::string> files;
+    for (uint64_t i = 0; i < NumFiles(config); i++) {
+        files.push_back(android::base::StringPrintf("%s/file%" PRIu64, src_dir.c_str(), i));
+        if (!WriteRandomFile(files.back(), kFileSize, &rng)) return false;
+    }
+
+    bool success = false;
+    unique_fd fd(open(image.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0600));
+    if (fd < 0 || ftruncate(fd, size) != 0) {
+        PLOG(ERROR) << "Failed to create " << image;
+    } else if (config.fs == "ext4") {
+        success = android::vold::ForkExecvp({"/system/bin/mke2fs", "-F", "-t", "ext4", "-b",
+                                             "4096", "-d", src_dir, image}) == android::OK;
+    } else if (config.fs == "f2fs") {
+        success = android::vold::ForkExecvp({"/system/bin/make_f2fs", "-f", image}) ==
+                          android::OK &&
+                  android::vold::ForkExecvp({"/system/bin/sload_f2fs", "-f", src_dir, image}) ==
+                          android::OK;
+    } else {
+        LOG(ERROR) << "Unknown filesystem " << config.fs;
+    }
+
+    for (const auto& file : files) unlink(file.c_str());
+    rmdir(src_dir.c_str());
+    return success;
+}
+
+static bool CopyFile(const std::string& from, const std::string& to) {
+    unique_fd in(open(from.c_str(), O_RDONLY | O_CLOEXEC));
+    unique_fd out(open(to.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600));
+    if (in < 0 || out < 0) {
+        PLOG(ERROR) << "Failed to copy " << from << " to " << to;
+        return false;
+    }
+    std::vector<char> buf(kFileSize);
+    ssize_t n;
+    while ((n = TEMP_FAILURE_RETRY(read(in, buf.data(), buf.size()))) > 0) {
+        if (!android::base::WriteFully(out, buf.data(), n)) break;
+    }
+    if (n != 0) {
+        PLOG(ERROR) << "Failed to copy " << from << " to " << to;
+        return false;
+    }
+    return true;
+}
+
+// Checks that |crypto_blkdev| reads back as the image that CreateImage() made.
+static bool VerifyImage(const Config& config, const std::string& crypto_blkdev) {
+    // Read from the devices, not from what the page cache kept of the writes.
+    DropCaches();
+
+    std::mt19937_64 rng(0);
+    if (config.fs == "none") {
+        unique_fd fd(open(crypto_blkdev.c_str(), O_RDONLY | O_CLOEXEC));
+        if (fd < 0) {
+            PLOG(ERROR) << "Failed to open " << crypto_blkdev;
+            return false;
+        }
+        return CheckRandomData(fd, crypto_blkdev, config.size_mb * 1024 * 1024, &rng);
+    }
+
+    if (config.fs == "ext4" &&
+        android::vold::ForkExecvp({"/system/bin/e2fsck", "-f", "-n", crypto_blkdev}) !=
+                android::OK) {
+        LOG(ERROR) << "e2fsck found errors on " << crypto_blkdev;
+        return false;
+    }
+
+    std::string mnt = config.dir + "/mnt";
+    if (android::vold::CreateDir(mnt, 0700) != android::OK) return false;
+    if (mount(crypto_blkdev.c_str(), mnt.c_str(), config.fs.c_str(),
+              MS_RDONLY | MS_NOSUID | MS_NODEV | MS_NOEXEC, nullptr) != 0) {
+        PLOG(ERROR) << "Failed to mount " << crypto_blkdev;
+        return false;
+    }
+    bool success = true;
+    for (uint64_t i = 0; success && i < NumFiles(config); i++) {
+        std::string path = android::base::StringPrintf("%s/file%" PRIu64, mnt.c_str(), i);
+        unique_fd fd(open(path.c_str(), O_RDONLY | O_CLOEXEC));
+        if (fd < 0) {
+            PLOG(ERROR) << "Failed to open " << path;
+            success = false;
+        } else {
+            success = CheckRandomData(fd, path, kFileSize, &rng);
+        }
+    }
+    if (umount(mnt.c_str()) != 0) PLOG(WARNING) << "Failed to unmount " << mnt;
+    rmdir(mnt.c_str());
+    return success;
+}
+
+// Encrypts |image| in-place once, and returns the time that took in |seconds|
+// and the amount of data that was encrypted in |bytes|.
+static bool RunOne(const Config& config, const std::string& image,
+                   const EncryptInPlaceOptions& options, double* seconds, uint64_t* bytes) {
+    std::string loop_dev;
+    if (Loop::create(image, loop_dev) != 0) return false;
+
+    bool success = false;
+    uint64_t nr_sec;
+    DmTable table;
+    if (android::vold::GetBlockDev512Sectors(loop_dev, &nr_sec) != android::OK) {
+        LOG(ERROR) << "Failed to get size of " << loop_dev;
+    } else if (config.target == "crypt") {
+        std::string key, hex_key;
+        if (android::vold::ReadRandomBytes(64, key) == android::OK &&
+            android::vold::StrToHex(key, hex_key) == android::OK) {
+            table.AddTarget(std::make_unique<DmTargetCrypt>(0, nr_sec, "aes-xts-plain64",
+                                                            hex_key, 0, loop_dev, 0));
+        }
+    } else {
+        table.AddTarget(std::make_unique<DmTargetLinear>(0, nr_sec, loop_dev, 0));
+    }
+
+    auto& dm = DeviceMapper::Instance();
+    std::string crypto_blkdev;
+    if (table.num_targets() != 0 && dm.CreateDevice(kDmName, table, &crypto_blkdev, 5s)) {
+        DropCaches();
+
+        auto start = std::chrono::steady_clock::now();
+        success = encrypt_inplace(crypto_blkdev, loop_dev, nr_sec, options, bytes);
+        *seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        if (success) success = VerifyImage(config, crypto_blkdev);
+
+        if (!dm.DeleteDevice(kDmName)) LOG(ERROR) << "Failed to delete " << kDmName;
+    }
+    Loop::destroyByDevice(loop_dev.c_str());
+    return success;
+}
+
+int main(int argc, char** argv) {
+    android::base::InitLogging(argv, android::base::StderrLogger);
+
+    Config config;
+    int opt;
+    while ((opt = getopt(argc, argv, "hf:s:u:t:d:j:q:b:o:")) != -1) {
+        bool ok = true;
+        switch (opt) {
+            case 'f':
+                config.fs = optarg;
+                break;
+            case 's':
+                ok = android::base::ParseUint(optarg, &config.size_mb);
+                break;
+            case 'u':
+                ok = android::base::ParseUint(optarg, &config.fill_percent, 100u);
+                break;
+            case 't':
+                config.target = optarg;
+                ok = config.target == "crypt" || config.target == "linear";
+                break;
+            case 'd':
+                config.dir = optarg;
+                break;
+            case 'j':
+                ok = ParseList(optarg, &config.threads);
+                break;
+            case 'q':
+                ok = ParseList(optarg, &config.queue_depths);
+                break;
+            case 'b':
+                ok = ParseList(optarg, &config.io_sizes_kb);
+                break;
+            case 'o':
+                ok = ParseList(optarg, &config.direct_io);
+                break;
+            case 'h':
+                usage(std::cout, argv[0]);
+                return EXIT_SUCCESS;
+            default:
+                ok = false;
+        }
+        if (!ok) {
+            usage(std::cerr, argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (android::vold::CreateDir(config.dir, 0700) != android::OK) return EXIT_FAILURE;
+    std::string pristine = config.dir + "/pristine.img";
+    std::string image = config.dir + "/work.img";
+    std::cerr << "Creating " << config.size_mb << " MB " << config.fs << " image..." << std::endl;
+    if (!CreateImage(config, pristine)) return EXIT_FAILURE;
+
+    std::cout << "fs\ttarget\tthreads\tqdepth\tio_kb\tdirect\tseconds\tMB/s" << std::endl;
+    int ret = EXIT_SUCCESS;
+    for (unsigned int threads : config.threads) {
+        for (unsigned int queue_depth : config.queue_depths) {
+            for (unsigned int io_size_kb : config.io_sizes_kb) {
+                for (unsigned int direct_io : config.direct_io) {
+                    // dm-linear leaves the image unchanged, but dm-crypt
+                    // doesn't, so then every run starts from a fresh copy.
+                    std::string run_image = pristine;
+                    if (config.target == "crypt") {
+                        if (!CopyFile(pristine, image)) return EXIT_FAILURE;
+                        run_image = image;
+                    }
+
+                    EncryptInPlaceOptions options;
+                    options.threads = threads;
+                    options.queue_depth = queue_depth;
+                    options.io_size_kb = io_size_kb;
+                    options.direct_io = direct_io != 0;
+                    double seconds = 0;
+                    uint64_t bytes = 0;
+                    bool success = RunOne(config, run_image, options, &seconds, &bytes);
+
+                    std::cout << config.fs << "\t" << config.target << "\t" << threads << "\t"
+                              << queue_depth << "\t" << io_size_kb << "\t" << direct_io << "\t";
+                    if (success) {
+                        std::cout << std::fixed << std::setprecision(2) << seconds << "\t"
+                                  << bytes / 1e6 / seconds << std::endl;
+                    } else {
+                        std::cout << "FAILED" << std::endl;
+                        ret = EXIT_FAILURE;
+                    }
+                }
+            }
+        }
+    }
+    unlink(image.c_str());
+    unlink(pristine.c_str());
+    return ret;
+}
@@ -311,10 +311,7 @@ status_t EmulatedVolume::unmountSdcardFs() {
         return OK;
     }
 
-    ForceUnmount(mSdcardFsDefault);
-    ForceUnmount(mSdcardFsRead);
-    ForceUnmount(mSdcardFsWrite);
-    ForceUnmount(mSdcardFsFull);
+    ForceUnmountAll({mSdcardFsDefault, mSdcardFsRead, mSdcardFsWrite, mSdcardFsFull});
 
     rmdir(mSdcardFsDefault.c_str());
     rmdir(mSdcardFsRead.c_str());
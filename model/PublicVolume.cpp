@@ -341,10 +341,7 @@ status_t PublicVolume::doUnmount() {
     ForceUnmount(kAsecPath);
 
     if (mUseSdcardFs) {
-        ForceUnmount(mSdcardFsDefault);
-        ForceUnmount(mSdcardFsRead);
-        ForceUnmount(mSdcardFsWrite);
-        ForceUnmount(mSdcardFsFull);
+        ForceUnmountAll({mSdcardFsDefault, mSdcardFsRead, mSdcardFsWrite, mSdcardFsFull});
 
         rmdir(mSdcardFsDefault.c_str());
         rmdir(mSdcardFsRead.c_str());
@@ -0,0 +1,293 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <string.h>
+
+#include <iterator>
+#include <map>
+#include <random>
+#include <set>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "Checkpoint.h"
+#include "Crc32.h"
+
+namespace android {
+namespace vold {
+
+namespace {
+
+// The on-disk log format of dm-bow.
+struct log_entry {
+    uint64_t source;  // in sectors of 512 bytes
+    uint64_t dest;    // in sectors of 512 bytes
+    uint32_t size;    // in bytes
+    uint32_t checksum;
+} __attribute__((packed));
+
+struct log_sector_v1_0 {
+    uint32_t magic;
+    uint16_t header_version;
+    uint16_t header_size;
+    uint32_t block_size;
+    uint32_t count;
+    uint32_t sequence;
+    uint64_t sector0;
+} __attribute__((packed));
+
+constexpr uint32_t kMagic = 0x00574f42;
+constexpr uint32_t kBlockSize = 4096;
+constexpr uint64_t kSectorsPerBlock = kBlockSize / 512;
+constexpr size_t kMaxEntries = (kBlockSize - sizeof(log_sector_v1_0)) / sizeof(log_entry);
+
+// A device image on which dm-bow has logged random writes.  The upper half is
+// treated as free when the checkpoint started, so that is where old data is
+// copied to, and its contents don't matter after the restore.
+class CheckpointImage {
+  public:
+    CheckpointImage(uint32_t blocks, uint32_t writes, uint64_t seed)
+        : blocks_(blocks), rng_(seed), data_(blocks * kBlockSize) {
+        for (auto& c : data_) c = rng_();
+        original_ = data_;
+        for (uint32_t block = blocks / 2; block < blocks; block++) free_.insert(block);
+
+        uint32_t dest = Copy(0);
+        sector0_ = dest * kSectorsPerBlock;
+        AddEntry(0, dest);
+        for (uint32_t i = 0; i < writes; i++) {
+            // Reuse a block holding a copy every fifth write, as a filesystem
+            // would for blocks it had free when the checkpoint started.
+            if (!copies_.empty() && rng_() % 5 == 0) {
+                Write(*std::next(copies_.begin(), rng_() % copies_.size()));
+            } else {
+                Write(1 + rng_() % (blocks - 1));
+            }
+        }
+        WriteLogSector();
+    }
+
+    const std::vector<char>& data() const { return data_; }
+
+    // Returns how many blocks of the lower half of |restored| differ from
+    // before the checkpoint.
+    int Mismatches(const std::vector<char>& restored) const {
+        int mismatches = 0;
+        for (uint32_t block = 0; block < blocks_ / 2; block++) {
+            if (memcmp(&restored[block * kBlockSize], &original_[block * kBlockSize],
+                       kBlockSize) != 0) {
+                mismatches++;
+            }
+        }
+        return mismatches;
+    }
+
+  private:
+    char* Block(uint32_t block) { return &data_[block * kBlockSize]; }
+
+    void Write(uint32_t block) {
+        if (copies_.count(block)) {
+            // The filesystem reuses a block holding a copy, so the copy moves
+            // again.  Freeing the block afterwards lets it be copied to again,
+            // which makes the restore read it before an earlier entry writes it.
+            AddEntry(block, Copy(block));
+            copies_.erase(block);
+            if (rng_() % 2) free_.insert(block);
+        } else if (block < blocks_ / 2 && !copied_.count(block)) {
+            AddEntry(block, Copy(block));
+            copied_.insert(block);
+        } else {
+            free_.erase(block);
+        }
+        for (size_t i = 0; i < kBlockSize; i++) Block(block)[i] = rng_();
+    }
+
+    // Copies |block| to a random free block, and returns that.
+    uint32_t Copy(uint32_t block) {
+        auto it = std::next(free_.begin(), rng_() % free_.size());
+        uint32_t dest = *it;
+        free_.erase(it);
+        copies_.insert(dest);
+        memcpy(Block(dest), Block(block), kBlockSize);
+        return dest;
+    }
+
+    void AddEntry(uint32_t block, uint32_t dest) {
+        if (entries_.size() == kMaxEntries) {
+            // Start a new log sector, after copying the full one like any other
+            // block.
+            WriteLogSector();
+            entries_.clear();
+            sequence_++;
+            uint32_t ls_dest = Copy(0);
+            entries_.push_back(Entry(0, ls_dest));
+        }
+        entries_.push_back(Entry(block, dest));
+    }
+
+    log_entry Entry(uint32_t block, uint32_t dest) {
+        uint32_t checksum = block;
+        crc32(Block(dest), kBlockSize, &checksum);
+        return {block * kSectorsPerBlock, dest * kSectorsPerBlock, kBlockSize, checksum};
+    }
+
+    void WriteLogSector() {
+        auto ls = reinterpret_cast<log_sector_v1_0*>(Block(0));
+        memset(ls, 0, kBlockSize);
+        ls->magic = kMagic;
+        ls->header_version = 1;
+        ls->header_size = sizeof(*ls);
+        ls->block_size = kBlockSize;
+        ls->count = entries_.size();
+        ls->sequence = sequence_;
+        ls->sector0 = sector0_;
+        memcpy(Block(0) + sizeof(*ls), entries_.data(), entries_.size() * sizeof(log_entry));
+    }
+
+    uint32_t blocks_;
+    std::mt19937_64 rng_;
+    std::vector<char> data_;
+    std::vector<char> original_;
+    std::set<uint32_t> free_;
+    std::set<uint32_t> copies_;
+    std::set<uint32_t> copied_;
+    std::vector<log_entry> entries_;
+    uint32_t sequence_ = 0;
+    uint64_t sector0_ = 0;
+};
+
+// A device in memory that can lose power.  Writes since the last Sync() are
+// lost or kept at random when it does.
+class CrashingDevice : public CheckpointDevice {
+  public:
+    explicit CrashingDevice(const std::vector<char>& data) : data_(data), synced_(data) {}
+
+    bool Read(void* data, size_t size, uint64_t offset) override {
+        if (lost_power_ || offset + size > data_.size()) return Fail();
+        memcpy(data, &data_[offset], size);
+        return true;
+    }
+
+    bool Write(const struct iovec* iov, int iovcnt, uint64_t offset) override {
+        if (!Operate()) return Fail();
+        for (int i = 0; i < iovcnt; i++) {
+            if (offset + iov[i].iov_len > data_.size()) return Fail();
+            memcpy(&data_[offset], iov[i].iov_base, iov[i].iov_len);
+            unsynced_[offset].assign(static_cast<char*>(iov[i].iov_base),
+                                     static_cast<char*>(iov[i].iov_base) + iov[i].iov_len);
+            offset += iov[i].iov_len;
+        }
+        return true;
+    }
+
+    bool Sync() override {
+        if (!Operate()) return Fail();
+        synced_ = data_;
+        unsynced_.clear();
+        return true;
+    }
+
+    // Loses power after |operations| more writes and syncs, or never if -1.
+    void LosePowerAfter(int operations) { operations_left_ = operations; }
+
+    // Comes back after losing power, with each unsynced write kept or lost.
+    void Restart(std::mt19937_64* rng) {
+        data_ = synced_;
+        for (const auto& [offset, data] : unsynced_) {
+            if ((*rng)() % 2) memcpy(&data_[offset], data.data(), data.size());
+        }
+        synced_ = data_;
+        unsynced_.clear();
+        lost_power_ = false;
+    }
+
+    const std::vector<char>& data() const { return data_; }
+    bool lost_power() const { return lost_power_; }
+    int operations() const { return operations_; }
+
+  private:
+    bool Operate() {
+        if (operations_left_ == 0) lost_power_ = true;
+        if (lost_power_) return false;
+        if (operations_left_ > 0) operations_left_--;
+        operations_++;
+        return true;
+    }
+
+    bool Fail() {
+        errno = EIO;
+        return false;
+    }
+
+    std::vector<char> data_;
+    std::vector<char> synced_;
+    // By offset.  Later writes to the same offset replace earlier ones.
+    std::map<uint64_t, std::vector<char>> unsynced_;
+    int operations_left_ = -1;
+    int operations_ = 0;
+    bool lost_power_ = false;
+};
+
+constexpr uint32_t kBlocks = 1024;
+constexpr uint32_t kWrites = 500;
+
+}  // namespace
+
+TEST(CheckpointRestoreTest, Restores) {
+    for (uint64_t seed = 0; seed < 4; seed++) {
+        CheckpointImage image(kBlocks, kWrites, seed);
+        CrashingDevice device(image.data());
+        ASSERT_TRUE(cp_restoreCheckpoint(&device, "test").isOk());
+        EXPECT_EQ(0, image.Mismatches(device.data())) << "seed " << seed;
+    }
+}
+
+// Loses power once during a restore, and again at each point of the restore
+// that resumes from there.  The restore that finally runs to the end must leave
+// the data of before the checkpoint, whichever unsynced writes were lost.
+TEST(CheckpointRestoreTest, SurvivesPowerLossWhileResuming) {
+    for (uint64_t seed = 0; seed < 3; seed++) {
+        CheckpointImage image(kBlocks, kWrites, seed);
+        std::mt19937_64 rng(seed);
+
+        CrashingDevice clean(image.data());
+        ASSERT_TRUE(cp_restoreCheckpoint(&clean, "test").isOk());
+        int operations = clean.operations();
+
+        for (int second = 1; second <= operations; second++) {
+            CrashingDevice device(image.data());
+            device.LosePowerAfter(1 + rng() % operations);
+            cp_restoreCheckpoint(&device, "test");
+            if (device.lost_power()) device.Restart(&rng);
+
+            device.LosePowerAfter(second);
+            cp_restoreCheckpoint(&device, "test");
+            if (device.lost_power()) device.Restart(&rng);
+
+            // If the restore got as far as writing back sector 0, there is
+            // nothing left to restore and this fails with "No magic".
+            device.LosePowerAfter(-1);
+            cp_restoreCheckpoint(&device, "test");
+            ASSERT_EQ(0, image.Mismatches(device.data()))
+                    << "seed " << seed << ", second power loss after " << second;
+        }
+    }
+}
+
+}  // namespace vold
+}  // namespace android
@@ -0,0 +1,87 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <random>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "../Crc32.h"
+
+namespace android {
+namespace vold {
+
+class Crc32Test : public testing::Test {
+  protected:
+    void SetUp() override {
+        std::mt19937 rng(42);
+        data_.resize(3 * 4096 + 64);
+        for (auto& byte : data_) byte = rng();
+    }
+
+    // Checks |fn| against the reference for every length up to a few blocks,
+    // starting at unaligned offsets and from a nonzero crc.
+    void ExpectMatchesReference(Crc32Function fn) {
+        for (size_t offset : {0, 1, 3, 8, 13}) {
+            for (size_t n = 0; n + offset <= data_.size(); n += n < 300 ? 1 : 61) {
+                uint32_t expected = n * 2654435761u;
+                uint32_t actual = expected;
+                crc32_reference(&data_[offset], n, &expected);
+                fn(&data_[offset], n, &actual);
+                ASSERT_EQ(expected, actual) << "offset " << offset << " length " << n;
+            }
+        }
+    }
+
+    std::vector<uint8_t> data_;
+};
+
+TEST_F(Crc32Test, ReferenceKnownValues) {
+    // The standard CRC-32 check value, which inverts the crc before and after.
+    uint32_t crc = ~0u;
+    crc32_reference("123456789", 9, &crc);
+    EXPECT_EQ(0xCBF43926u, ~crc);
+
+    crc = 0;
+    crc32_reference(nullptr, 0, &crc);
+    EXPECT_EQ(0u, crc);
+}
+
+TEST_F(Crc32Test, Slice8MatchesReference) {
+    ExpectMatchesReference(crc32_slice8);
+}
+
+TEST_F(Crc32Test, HardwareMatchesReference) {
+    Crc32Function fn = crc32_hardware();
+    if (fn == nullptr) GTEST_SKIP() << "No hardware crc32 on this CPU";
+    ExpectMatchesReference(fn);
+}
+
+TEST_F(Crc32Test, DefaultMatchesReference) {
+    ExpectMatchesReference(crc32);
+}
+
+TEST_F(Crc32Test, Incremental) {
+    uint32_t whole = 7;
+    crc32(data_.data(), 4096, &whole);
+    uint32_t parts = 7;
+    crc32(data_.data(), 1000, &parts);
+    crc32(data_.data() + 1000, 3096, &parts);
+    EXPECT_EQ(whole, parts);
+}
+
+}  // namespace vold
+}  // namespace android